@@ -0,0 +1,3885 @@
+/*
+ *	libmd2roff.c
+ *	The markdown to troff converter; see md2roff.h.
+ *
+ *	Copyright (C) 2017, Nicholas Christopoulos (mailto:nereus@freemail.gr)
+ *
+ *	License GPL3+
+ *	CC: std C99
+ * 	URL: http://github.com/nereusx/md2roff
+ * 
+ *	history:
+ *		20017-05-08, created
+ *		20019-02-10, cleanup
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License.
+ *	See LICENSE for details.
+ */
+
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "md2roff.h"
+
+// the short names of the packages of md2roff.h
+typedef md2roff_package_t macropackage_t;
+#define	mp_mm		MD2ROFF_MM
+#define	mp_man		MD2ROFF_MAN
+#define	mp_mdoc		MD2ROFF_MDOC
+#define	mp_mom		MD2ROFF_MOM
+
+#if !defined(MD2ROFF_NO_SIMD) && defined(__GNUC__)
+	#if defined(__x86_64__) || defined(__i386__)
+		#define	HAVE_AVX2
+		#include <immintrin.h>
+	#endif
+	#if defined(__SSE2__)
+		#define	HAVE_SSE2
+		#include <emmintrin.h>
+	#endif
+	#if defined(__ARM_NEON)
+		#define	HAVE_NEON
+		#include <arm_neon.h>
+	#endif
+#endif
+
+#if defined(__GNUC__)
+	#define	ALWAYS_INLINE	inline __attribute__((always_inline))
+#else
+	#define	ALWAYS_INLINE	inline
+#endif
+
+/*
+ * running out of memory is fatal for the converter
+ */
+static void nomem(void)
+{
+	fprintf(stderr, "md2roff: out of memory\n");
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * realloc() that does not return on failure
+ */
+static void *xrealloc(void *ptr, size_t size)
+{
+	if ( (ptr = realloc(ptr, size)) == NULL )
+		nomem();
+	return ptr;
+}
+
+/*
+ *	--- arena ---
+ *
+ *	the scratch memory of one conversion; it is taken in order and it is
+ *	released all together by arreset(). the arena keeps its last, and
+ *	largest, block, so once it has grown to the size the documents need,
+ *	a conversion allocates nothing and the reset is O(1).
+ */
+#define	ARENA_MIN	(16 * 1024)
+#define	ARENA_ALIGN(n)	(((n) + 15) & ~(size_t) 15)
+
+typedef struct arblock {
+	struct arblock	*next;	// older block
+	size_t			size;	// of the data, that follows the header
+	} arblock_t;
+
+typedef struct {
+	arblock_t	*head;		// the block in use
+	size_t		used;		// bytes of it
+	} arena_t;
+
+/*
+ * returns 'n' bytes of the arena 'a'
+ */
+static void *aralloc(arena_t *a, size_t n)
+{
+	arblock_t *b = a->head;
+
+	n = ARENA_ALIGN(n);
+	if ( b == NULL || b->size - a->used < n ) {
+		size_t size = ( b ) ? b->size * 2 : ARENA_MIN;
+		while ( size < n )
+			size *= 2;
+		b = (arblock_t *) xrealloc(NULL, ARENA_ALIGN(sizeof(arblock_t)) + size);
+		b->next = a->head;
+		b->size = size;
+		a->head = b;
+		a->used = 0;
+		}
+	a->used += n;
+	return (char *) b + ARENA_ALIGN(sizeof(arblock_t)) + a->used - n;
+}
+
+/*
+ * releases everything taken from 'a'; only the last block is kept
+ */
+static void arreset(arena_t *a)
+{
+	arblock_t *b, *next;
+
+	if ( a->head ) {
+		for ( b = a->head->next; b; b = next ) {
+			next = b->next;
+			free(b);
+			}
+		a->head->next = NULL;
+		}
+	a->used = 0;
+}
+
+/*
+ * releases the memory of 'a'
+ */
+static void arfree(arena_t *a)
+{
+	arreset(a);
+	free(a->head);
+	a->head = NULL;
+}
+
+/*
+ *	--- character classes ---
+ *
+ *	the class of each byte, by the bit of each test the converter does on
+ *	it; one lookup instead of the <ctype.h> calls, that depend on the
+ *	locale, and of the strchr() of a set. the table is built by the
+ *	compiler. bytes from 0x80 are parts of UTF-8 characters, they are
+ *	words; see utf8emph() for the punctuation.
+ */
+enum { C_SPACE = 1,		// blank, squeezed
+		C_WORD = 2,		// letter or digit, keeps the blanks beside it
+		C_DIGIT = 4,	// number of ordered list item
+		C_EMPH = 8,		// '*' and '_' open emphasis after it
+		C_ROFF = 16,	// '\\', the roff escape
+		C_SPECIAL = 32,	// markdown, see scan_bytes()
+		C_CTRL = 64 };	// roff request when it starts a line
+
+#define	CC2(c, v)	[(c)] = (v), [(c) + 1] = (v)
+#define	CC4(c, v)	CC2(c, v), CC2((c) + 2, v)
+#define	CC8(c, v)	CC4(c, v), CC4((c) + 4, v)
+#define	CC16(c, v)	CC8(c, v), CC8((c) + 8, v)
+#define	CC32(c, v)	CC16(c, v), CC16((c) + 16, v)
+#define	CC64(c, v)	CC32(c, v), CC32((c) + 32, v)
+#define	CC26(c, v)	CC16(c, v), CC8((c) + 16, v), CC2((c) + 24, v)
+
+static const unsigned char cclass[256] = {
+	['\0'] = C_EMPH | C_SPECIAL, ['\n'] = C_SPACE | C_EMPH | C_SPECIAL,
+	[' '] = C_SPACE | C_EMPH, ['\t'] = C_SPACE | C_EMPH,
+	['\v'] = C_SPACE, ['\f'] = C_SPACE, ['\r'] = C_SPACE,
+	['('] = C_EMPH, ['{'] = C_EMPH, ['['] = C_EMPH | C_SPECIAL,
+	[','] = C_EMPH, ['.'] = C_EMPH | C_CTRL, [';'] = C_EMPH,
+	['`'] = C_EMPH | C_SPECIAL, ['\''] = C_EMPH | C_CTRL, ['"'] = C_EMPH,
+	['\\'] = C_ROFF | C_SPECIAL,
+	['*'] = C_SPECIAL, ['_'] = C_SPECIAL, ['!'] = C_SPECIAL,
+	CC8('0', C_WORD | C_DIGIT), CC2('8', C_WORD | C_DIGIT),
+	CC26('A', C_WORD), CC26('a', C_WORD),
+	CC64(0x80, C_WORD), CC64(0xC0, C_WORD),
+	};
+
+#define	isclass(c, cl)	(cclass[(unsigned char) (c)] & (cl))
+
+/*
+ *	--- UTF-8 ---
+ *
+ *	roff reads its input as Latin-1, so the UTF-8 characters of the text
+ *	are written as glyphs, by name those that have one, as \[uXXXX] the
+ *	rest. bytes that are not UTF-8 are written as they are.
+ */
+
+/*
+ * decodes the character at 's' (up to 'end') into 'cp'; returns its length,
+ * or 0 if it is not valid UTF-8 (truncated, overlong, a surrogate or past
+ * U+10FFFF)
+ */
+static int utf8dec(const char *s, const char *end, uint32_t *cp)
+{
+	static const uint32_t least[5] = { 0, 0, 0x80, 0x800, 0x10000 };
+	const unsigned char *p = (const unsigned char *) s;
+	uint32_t	c = *p;
+	int			len;
+
+	if ( c < 0x80 ) {
+		*cp = c;
+		return 1;
+		}
+	if ( c < 0xC2 || c > 0xF4 ) // a continuation, an overlong pair or past U+10FFFF
+		return 0;
+	len = ( c >= 0xF0 ) ? 4 : ( c >= 0xE0 ) ? 3 : 2;
+	if ( end - s < len )
+		return 0;
+	c &= 0x3F >> (len - 1);
+	for ( int i = 1; i < len; i ++ ) {
+		if ( (p[i] & 0xC0) != 0x80 )
+			return 0;
+		c = (c << 6) | (p[i] & 0x3F);
+		}
+	if ( c < least[len] || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF) )
+		return 0;
+	*cp = c;
+	return len;
+}
+
+/*
+ * the characters with a roff glyph, sorted by code point; 'emph' is set
+ * for the punctuation that emphasis may follow, as the C_EMPH bytes.
+ */
+typedef struct {
+	uint16_t	cp;
+	bool		emph;
+	char		roff[6];
+	} glyph_t;
+
+static const glyph_t glyphs[] = {
+	{ 0x00A0, true,  "\\~" },  { 0x00A1, true,  "\\(r!" }, { 0x00A2, false, "\\(ct" },
+	{ 0x00A3, false, "\\(Po" }, { 0x00A5, false, "\\(Ye" }, { 0x00A7, false, "\\(sc" },
+	{ 0x00A9, false, "\\(co" }, { 0x00AB, true,  "\\(Fo" }, { 0x00AD, false, "\\%" },
+	{ 0x00AE, false, "\\(rg" }, { 0x00B0, false, "\\(de" }, { 0x00B1, false, "\\(+-" },
+	{ 0x00B6, false, "\\(ps" }, { 0x00B7, false, "\\(pc" }, { 0x00BB, true,  "\\(Fc" },
+	{ 0x00BF, true,  "\\(r?" }, { 0x00D7, false, "\\(mu" }, { 0x00F7, false, "\\(di" },
+	{ 0x2010, true,  "\\(hy" }, { 0x2013, true,  "\\(en" }, { 0x2014, true,  "\\(em" },
+	{ 0x2018, true,  "\\(oq" }, { 0x2019, true,  "\\(cq" }, { 0x201A, true,  "\\(bq" },
+	{ 0x201C, true,  "\\(lq" }, { 0x201D, true,  "\\(rq" }, { 0x201E, true,  "\\(Bq" },
+	{ 0x2020, false, "\\(dg" }, { 0x2021, false, "\\(dd" }, { 0x2022, true,  "\\(bu" },
+	{ 0x2030, false, "\\(%0" }, { 0x2032, false, "\\(fm" }, { 0x2033, false, "\\(sd" },
+	{ 0x2039, true,  "\\(fo" }, { 0x203A, true,  "\\(fc" }, { 0x20AC, false, "\\(Eu" },
+	{ 0x2122, false, "\\(tm" }, { 0x2190, false, "\\(<-" }, { 0x2192, false, "\\(->" },
+	{ 0x2194, false, "\\(<>" }, { 0x21D2, false, "\\(rA" }, { 0x2212, false, "\\(mi" },
+	{ 0x221E, false, "\\(if" }, { 0x2248, false, "\\(~~" }, { 0x2260, false, "\\(!=" },
+	{ 0x2261, false, "\\(==" }, { 0x2264, false, "\\(<=" }, { 0x2265, false, "\\(>=" },
+	};
+#define	GLYPHS	(int) (sizeof(glyphs) / sizeof(glyphs[0]))
+
+/*
+ * returns the glyph of the code point 'cp', or NULL
+ */
+static const glyph_t *findglyph(uint32_t cp)
+{
+	int lo = 0, hi = GLYPHS;
+
+	while ( lo < hi ) {
+		int mid = (lo + hi) / 2;
+		if ( glyphs[mid].cp < cp )
+			lo = mid + 1;
+		else
+			hi = mid;
+		}
+	return ( lo < GLYPHS && glyphs[lo].cp == cp ) ? &glyphs[lo] : NULL;
+}
+
+/*
+ * true if the character before 'p' (from 'start') is not ASCII and it is
+ * punctuation that emphasis may follow, as a quote or a dash
+ */
+static bool utf8emph(const char *start, const char *p)
+{
+	const char	*q = p - 1;
+	uint32_t	cp;
+	const glyph_t *g;
+
+	if ( p == start || (unsigned char) *q < 0x80 )
+		return false;
+	while ( q > start && p - q < 4 && (*q & 0xC0) == 0x80 )
+		q --;
+	return utf8dec(q, p, &cp) == p - q && (g = findglyph(cp)) != NULL && g->emph;
+}
+
+/*
+ * returns the first byte in [p, end) that is not ASCII, or end
+ */
+static inline const char *scan_ascii(const char *p, const char *end)
+{
+	uint64_t w;
+
+#ifdef HAVE_SSE2
+	while ( end - p >= 16 ) {
+		int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) p));
+		if ( mask )
+			return p + __builtin_ctz(mask);
+		p += 16;
+		}
+#endif
+	while ( end - p >= 8 ) {
+		memcpy(&w, p, 8);
+		if ( w & 0x8080808080808080ULL )
+			break;
+		p += 8;
+		}
+	while ( p < end && (unsigned char) *p < 0x80 )
+		p ++;
+	return p;
+}
+
+/*
+ *	squeeze, in place, the 'len' bytes of 's' and returns the new length.
+ *	leading and trailing blanks are removed, and each run of blanks
+ *	becomes one space if there is a letter or digit on either side.
+ *	'utf8' is set if any byte is not ASCII.
+ *
+ *	the output is never longer than the input, so writing over it is
+ *	safe; 'p - 1' is either untouched or was rewritten with itself.
+ */
+static size_t sqzln(char *s, size_t len, bool *utf8)
+{
+	char *p = s, *end = s + len, *d = s;
+	bool lc = false;
+	unsigned char hi = 0;
+
+	while ( p < end && isclass(*p, C_SPACE) ) p ++;
+
+	while ( p < end ) {
+		if ( isclass(*p, C_SPACE) ) {
+			if ( !lc ) {
+				lc = true;
+				if ( isclass(*(p - 1), C_WORD) )
+					*d ++ = ' ';
+				else {
+					const char *nc = p;
+					while ( nc < end && isclass(*nc, C_SPACE) )
+						nc ++;
+					if ( nc < end && isclass(*nc, C_WORD) )
+						*d ++ = ' ';
+					}
+				}
+			}
+		else {
+			lc = false;
+			hi |= *p;
+			*d ++ = *p;
+			}
+		p ++;
+		}
+
+	if ( d > s && isclass(*(d - 1), C_SPACE) )
+		d --;
+	*utf8 = hi & 0x80;
+	return d - s;
+}
+
+/*
+ * growable character buffer;
+ * 'data' is always valid for 'len' + 1 bytes, so it can be terminated.
+ */
+typedef md2roff_buf strbuf_t;
+
+#define	SB_MIN_SIZE	4096
+
+/*
+ * makes room for at least 'n' more bytes (plus the terminator);
+ * the size doubles, so appending is amortized O(1).
+ */
+static void sbgrow(strbuf_t *b, size_t n)
+{
+	size_t need = b->len + n + 1, size = (b->size) ? b->size : SB_MIN_SIZE;
+
+	if ( need < b->len )
+		nomem();
+	while ( size < need ) {
+		if ( size * 2 < size )
+			nomem();
+		size *= 2;
+		}
+	if ( size != b->size ) {
+		b->data = (char *) xrealloc(b->data, size);
+		b->size = size;
+		}
+}
+
+/*
+ * adds the character 'c' to buffer 'b'
+ */
+static inline void sbputc(strbuf_t *b, int c)
+{
+	if ( b->len + 1 >= b->size )
+		sbgrow(b, 1);
+	b->data[b->len ++] = c;
+}
+
+/*
+ * adds 'n' bytes of 'str' to buffer 'b'
+ */
+static void sbnadd(strbuf_t *b, const char *str, size_t n)
+{
+	if ( b->len + n >= b->size )
+		sbgrow(b, n);
+	memcpy(b->data + b->len, str, n);
+	b->len += n;
+}
+
+/*
+ * appends the 'n' bytes of text 'str' as roff reads them; the escape
+ * character becomes \e
+ */
+static void sbnesc(strbuf_t *b, const char *str, size_t n)
+{
+	const char *p = str, *end = str + n;
+
+	for ( ; p < end; p ++ ) {
+		if ( isclass(*p, C_ROFF) ) {
+			sbnadd(b, str, p - str);
+			sbnadd(b, "\\e", 2);
+			str = p + 1;
+			}
+		}
+	sbnadd(b, str, end - str);
+}
+
+/*
+ * terminates and returns the contents of 'b'
+ */
+static char *sbcstr(strbuf_t *b)
+{
+	if ( b->size == 0 )
+		sbgrow(b, 0);
+	b->data[b->len] = '\0';
+	return b->data;
+}
+
+/*
+ * the requests of a package that ocompact() knows; the lists end with NULL
+ */
+typedef struct {
+	const char	*par;			// the paragraph request line
+	const char	*starts[6];		// requests that start a paragraph or a section themselves
+	const char	*empty[4];		// heading requests, a line of one alone is an empty heading
+	} compact_t;
+
+/*
+ * output writer;
+ * every roff byte goes through it. It collects the output in 'b' and
+ * either writes it to 'fd' in large blocks, or, when 'fd' is -1, keeps
+ * it in a caller supplied memory buffer.
+ */
+typedef struct {
+	strbuf_t	*b;
+	strbuf_t	own;	// the buffer of the descriptor writer
+	int			fd;
+	int			err;	// errno of the first failed write, the rest is dropped
+	size_t		sent;	// bytes given to the descriptor
+	size_t		base;	// length of the memory buffer at the start
+
+	// compaction, see ocompact()
+	const compact_t *cpt;	// its rules, NULL to write the output as it is
+	size_t		done;		// the bytes of 'b' before it are compacted
+	bool		held;		// and they end with a paragraph request that may be dropped
+	bool		midline;	// 'done' is after the start of a line
+	size_t		saved;		// bytes dropped
+	} out_t;
+
+#define	OUT_BUFSIZE	(64 * 1024)
+#define	COMPACT_LOOK	24		// bytes of the start of a line that decide it
+
+/*
+ * setup 'o' to write to the descriptor 'fd'
+ */
+static void outfd(out_t *o, int fd)
+{
+	o->b = &o->own;
+	o->b->len = 0;
+	o->fd = fd;
+	o->err = 0;
+	o->sent = o->base = 0;
+	o->cpt = NULL;
+	o->done = o->saved = 0;
+	o->held = o->midline = false;
+	if ( o->own.size < OUT_BUFSIZE )
+		sbgrow(o->b, OUT_BUFSIZE);
+}
+
+/*
+ * setup 'o' to append to the memory buffer 'mem'
+ */
+static void outmem(out_t *o, strbuf_t *mem)
+{
+	o->b = mem;
+	o->fd = -1;
+	o->err = 0;
+	o->sent = 0;
+	o->base = mem->len;
+	o->cpt = NULL;
+	o->done = mem->len;
+	o->saved = 0;
+	o->held = o->midline = false;
+}
+
+/*
+ * returns the bytes written to 'o' since it was set up
+ */
+static size_t obytes(const out_t *o)
+{
+	return o->sent + o->b->len - o->base;
+}
+
+/*
+ * true if the line [p, end) starts with the request 'req'
+ */
+static bool isreq(const char *p, const char *end, const char *req)
+{
+	size_t n = strlen(req);
+
+	return (size_t) (end - p) > n && memcmp(p, req, n) == 0 && (p[n] == ' ' || p[n] == '\n');
+}
+
+/*
+ * true if [p, end) is 'str'
+ */
+static bool iseq(const char *p, const char *end, const char *str)
+{
+	size_t n = strlen(str);
+
+	return (size_t) (end - p) == n && memcmp(p, str, n) == 0;
+}
+
+/*
+ * compacts, in place, the output of 'o' after 'done': drops a paragraph
+ * request that the next line makes redundant, another paragraph or a
+ * section, or that ends the document, and the empty headings (roff
+ * would take the next line for the heading).
+ * a line is decided by its first COMPACT_LOOK bytes, so, unless this is
+ * the 'last' call of the document, a shorter start of line at the end
+ * waits for more output, and a paragraph request for the line after it;
+ * the result does not depend on how the output was written.
+ */
+static void ocompact(out_t *o, bool last)
+{
+	const compact_t *c = o->cpt;
+	char	*s = o->b->data, *r = s + o->done, *w = r, *end = s + o->b->len;
+	const char *nl, *q;
+	size_t	plen = strlen(c->par);
+
+	while ( r < end ) {
+		if ( !o->midline ) { // a start of line
+			size_t	look = ( end - r < COMPACT_LOOK ) ? end - r : COMPACT_LOOK;
+			bool	start = false, empty = false;
+
+			nl = memchr(r, '\n', look);
+			if ( nl == NULL && look < COMPACT_LOOK && !last )
+				break;
+			q = ( nl ) ? nl + 1 : r + look;
+			for ( int i = 0; nl && c->empty[i] && !empty; i ++ )
+				empty = iseq(r, nl, c->empty[i]);
+			if ( empty ) {
+				o->saved += q - r;
+				r += q - r;
+				continue;
+				}
+			for ( int i = 0; c->starts[i] && !start; i ++ )
+				start = isreq(r, q, c->starts[i]);
+			if ( o->held && start ) {
+				w -= plen;
+				o->saved += plen;
+				}
+			o->held = nl && iseq(r, q, c->par);
+			}
+		nl = memchr(r, '\n', end - r);
+		q = ( nl ) ? nl + 1 : end;
+		memmove(w, r, q - r);
+		w += q - r;
+		r += q - r;
+		o->midline = ( nl == NULL );
+		}
+	memmove(w, r, end - r); // the start that waits
+	o->b->len = (w - s) + (end - r);
+	o->done = w - s;
+	if ( last && o->held ) { // the end of the document
+		o->b->len -= plen;
+		o->done -= plen;
+		o->saved += plen;
+		o->held = false;
+		}
+}
+
+/*
+ * writes the 'cnt' vectors of 'iov' to 'o', retrying on partial writes
+ */
+static void writeall(out_t *o, struct iovec *iov, int cnt)
+{
+	while ( cnt && o->err == 0 ) {
+		ssize_t n = writev(o->fd, iov, cnt);
+		if ( n < 0 ) {
+			if ( errno != EINTR )
+				o->err = errno;
+			continue;
+			}
+		while ( cnt && (size_t) n >= iov->iov_len ) {
+			n -= iov->iov_len;
+			iov ++;
+			cnt --;
+			}
+		if ( cnt ) {
+			iov->iov_base = (char *) iov->iov_base + n;
+			iov->iov_len -= n;
+			}
+		}
+}
+
+/*
+ * writes the buffered output, plus the 'n' bytes of 'tail', to the descriptor
+ */
+static void oflushv(out_t *o, const char *tail, size_t n)
+{
+	struct iovec iov[2];
+	int cnt = 0;
+	size_t len = o->b->len, keep = 0;
+
+	if ( o->cpt ) { // what ocompact() has not decided stays
+		ocompact(o, false);
+		keep = o->b->len - o->done + ( ( o->held ) ? strlen(o->cpt->par) : 0 );
+		len = o->b->len - keep;
+		}
+	if ( len ) {
+		iov[cnt].iov_base = o->b->data;
+		iov[cnt].iov_len = len;
+		cnt ++;
+		}
+	if ( n ) {
+		iov[cnt].iov_base = (char *) tail;
+		iov[cnt].iov_len = n;
+		cnt ++;
+		}
+	o->sent += len + n;
+	writeall(o, iov, cnt);
+	if ( keep ) {
+		memmove(o->b->data, o->b->data + len, keep);
+		o->done -= len;
+		}
+	else
+		o->done = 0;
+	o->b->len = keep;
+}
+
+/*
+ * writes all pending output
+ */
+static void oflush(out_t *o)
+{
+	if ( o->fd >= 0 && o->b->len )
+		oflushv(o, NULL, 0);
+}
+
+/*
+ * writes all the output, at the end of the document
+ */
+static void oend(out_t *o)
+{
+	if ( o->cpt )
+		ocompact(o, true);
+	oflush(o);
+}
+
+/*
+ * writes the 'n' bytes of 'src'
+ */
+static void owrite(out_t *o, const char *src, size_t n)
+{
+	strbuf_t *b = o->b;
+
+	if ( b->len + n < b->size || o->fd < 0 )
+		sbnadd(b, src, n);
+	else if ( n >= OUT_BUFSIZE / 2 && o->cpt == NULL )
+		oflushv(o, src, n);	// big spans go out directly, without copy
+	else {
+		oflushv(o, NULL, 0);
+		sbnadd(b, src, n);
+		}
+}
+
+/*
+ * writes a character
+ */
+static inline void oputc(out_t *o, int c)
+{
+	strbuf_t *b = o->b;
+
+	if ( b->len + 1 >= b->size ) {
+		if ( o->fd >= 0 )
+			oflushv(o, NULL, 0);
+		else
+			sbgrow(b, 1);
+		}
+	b->data[b->len ++] = c;
+}
+
+/*
+ * writes the string 'str'
+ */
+static inline void ostr(out_t *o, const char *str)
+{
+	owrite(o, str, strlen(str));
+}
+
+/*
+ * writes the string 'str' and a new-line, as puts() does
+ */
+static inline void oputs(out_t *o, const char *str)
+{
+	owrite(o, str, strlen(str));
+	oputc(o, '\n');
+}
+
+/*
+ * formatted output, formats directly into the buffer
+ */
+static void oprintf(out_t *o, const char *fmt, ...)
+{
+	strbuf_t *b = o->b;
+	va_list	ap;
+	int		n;
+	bool	flushed = false;
+
+	for ( ;; ) {
+		size_t room = b->size - b->len;
+		va_start(ap, fmt);
+		n = vsnprintf(b->data + b->len, room, fmt, ap);
+		va_end(ap);
+		if ( n < 0 )
+			return;
+		if ( (size_t) n < room )
+			break;
+		if ( o->fd >= 0 && b->len && !flushed ) {
+			oflushv(o, NULL, 0);
+			flushed = true; // compaction may keep some
+			}
+		else
+			sbgrow(b, n);
+		}
+	b->len += n;
+}
+
+/*
+ * writes the character at 'p' (up to 'end'), that is not ASCII, as a roff
+ * glyph, and returns the next one; a byte that is not UTF-8 as it is.
+ */
+static const char *oglyph(out_t *o, const char *p, const char *end)
+{
+	const glyph_t *g;
+	uint32_t	cp;
+	int			len = utf8dec(p, end, &cp);
+
+	if ( len == 0 ) {
+		oputc(o, *p);
+		return p + 1;
+		}
+	if ( (g = findglyph(cp)) != NULL )
+		ostr(o, g->roff);
+	else {
+		char	u[12] = "\\[u";
+		int		k = 3;
+
+		for ( int sh = ( cp > 0xFFFFF ) ? 20 : ( cp > 0xFFFF ) ? 16 : 12; sh >= 0; sh -= 4 )
+			u[k ++] = "0123456789ABCDEF"[(cp >> sh) & 15];
+		u[k ++] = ']';
+		owrite(o, u, k);
+		}
+	return p + len;
+}
+
+/*
+ * writes the 'n' bytes of text 'src', with the UTF-8 characters as roff
+ * glyphs; ASCII is copied in spans, as owrite() does.
+ */
+static void otext(out_t *o, const char *src, size_t n)
+{
+	const char	*p, *end = src + n;
+
+	while ( (p = scan_ascii(src, end)) < end ) {
+		owrite(o, src, p - src);
+		src = oglyph(o, p, end);
+		}
+	owrite(o, src, end - src);
+}
+
+/*
+ * writes the 'n' bytes of markdown text 'src' as otext(), with the escapes
+ * of markdown: \x of a punctuation character is x, the other backslashes
+ * (and \\) are \e. a control character at the start is written after \&,
+ * so the text can start a line.
+ */
+static void oescape(out_t *o, const char *src, size_t n)
+{
+	const char	*p, *end = src + n;
+	const char	*c = ( n > 1 && *src == '\\' ) ? src + 1 : src;
+
+	if ( n && isclass(*c, C_CTRL) )
+		owrite(o, "\\&", 2);
+	for ( p = src; p < end; p ++ ) {
+		if ( isclass(*p, C_ROFF) ) {
+			otext(o, src, p - src);
+			if ( p + 1 < end && *(p+1) > ' ' && *(p+1) < 0x7F
+					&& !isclass(*(p+1), C_WORD | C_ROFF) )
+				p ++; // written with the text that follows
+			else
+				owrite(o, "\\e", 2);
+			src = ( *p == '\\' ) ? p + 1 : p;
+			}
+		}
+	otext(o, src, end - src);
+}
+
+/*
+ * writes the 'n' bytes of 'src' as oescape(), as the argument of a
+ * request, that is not at the start of a line; a file name as "./file"
+ * is not written as "\&./file".
+ */
+static void oarg(out_t *o, const char *src, size_t n)
+{
+	if ( n && isclass(*src, C_CTRL) ) {
+		oputc(o, *src);
+		src ++, n --;
+		}
+	oescape(o, src, n);
+}
+
+/*
+ * prints the whole line of markdown text 'src' (up to 'end'), as
+ * oescape(), and returns pointer to the next character (the first of
+ * the next line).
+ */
+static const char *println(out_t *o, const char *src, const char *end)
+{
+	const char *p = memchr(src, '\n', end - src);
+
+	p = ( p ) ? p + 1 : end;
+	oescape(o, src, p - src);
+	return p;
+}
+
+/*
+ * a search for a character that is remembered; the first one at or
+ * after 'from' is 'at', 'at' is the end if there is none
+ */
+typedef struct { const char *from, *at; } seek_t;
+
+/*
+ * returns the first 'c' in [p, pend), or NULL, as memchr(); a search from
+ * between the last one and its answer has the same answer, so while 'p'
+ * moves on each byte is searched once. 'pend' must be the same for all
+ * the searches of 's', that starts zeroed.
+ */
+static inline const char *seekchr(seek_t *s, const char *p, const char *pend, int c)
+{
+	if ( s->from == NULL || p < s->from || p > s->at ) {
+		s->from = p;
+		if ( (s->at = memchr(p, c, pend - p)) == NULL )
+			s->at = pend;
+		}
+	return ( s->at < pend ) ? s->at : NULL;
+}
+
+/*
+ * returns true if the text at 'p' (up to 'end') begins with 'prefix'
+ */
+static inline bool isprefix(const char *p, const char *end, const char *prefix)
+{
+	size_t n = strlen(prefix);
+	return (size_t) (end - p) >= n && memcmp(p, prefix, n) == 0;
+}
+
+/*
+ *	hash of the 'len' bytes of 'p', never 0
+ */
+static uint64_t hashmem(const char *p, size_t len)
+{
+	uint64_t h = 0x9e3779b97f4a7c15ULL ^ len, w;
+
+	for ( ; len >= 8; p += 8, len -= 8 ) {
+		memcpy(&w, p, 8);
+		h = (h ^ (w * 0x87c37b91114253d5ULL)) * 0x4cf5ad432745937fULL;
+		h ^= h >> 29;
+		}
+	for ( ; len; p ++, len -- )
+		h = (h ^ (unsigned char) *p) * 0x100000001b3ULL;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return ( h ) ? h : 1;
+}
+
+/*
+ *	--- scanning for special characters ---
+ *
+ *	mdinline() and textend() look at these bytes, anything else is
+ *	plain text and it is copied as one block. the scanners return the
+ *	first special byte in [p, end), or end; the vector ones test a whole
+ *	block and leave the bytes of a hit, and the tail, to scan_bytes().
+ *	md2roff_new() picks the best one the CPU can run; the bytes are the
+ *	C_SPECIAL class.
+ */
+typedef const char *(*scan_t)(const char *p, const char *end);
+
+static const char *scan_bytes(const char *p, const char *end)
+{
+	while ( p < end && !isclass(*p, C_SPECIAL) )
+		p ++;
+	return p;
+}
+
+#if !defined(HAVE_SSE2) && !defined(HAVE_NEON)
+/*
+ * portable fallback, eight bytes at a time in a 64-bit word
+ */
+#define	SWAR_ONES	((uint64_t) 0x0101010101010101ULL)
+#define	SWAR_HIGH	(SWAR_ONES * 0x80)
+
+// non-zero if any byte of 'w' is 'c'
+static inline uint64_t swarhas(uint64_t w, int c)
+{
+	uint64_t v = w ^ (SWAR_ONES * (unsigned char) c);
+	return (v - SWAR_ONES) & ~v & SWAR_HIGH;
+}
+
+static const char *scan_swar(const char *p, const char *end)
+{
+	uint64_t w;
+
+	while ( end - p >= 8 ) {
+		memcpy(&w, p, 8);
+		if ( swarhas(w, '\0') | swarhas(w, '\n') | swarhas(w, '\\') | swarhas(w, '`')
+				| swarhas(w, '*') | swarhas(w, '_') | swarhas(w, '[') | swarhas(w, '!') )
+			break;
+		p += 8;
+		}
+	return scan_bytes(p, end);
+}
+#endif
+
+#ifdef HAVE_SSE2
+static const char *scan_sse2(const char *p, const char *end)
+{
+	const __m128i c0 = _mm_set1_epi8('\0'), c1 = _mm_set1_epi8('\n');
+	const __m128i c2 = _mm_set1_epi8('\\'), c3 = _mm_set1_epi8('`');
+	const __m128i c4 = _mm_set1_epi8('*'), c5 = _mm_set1_epi8('_');
+	const __m128i c6 = _mm_set1_epi8('['), c7 = _mm_set1_epi8('!');
+
+	while ( end - p >= 16 ) {
+		__m128i v = _mm_loadu_si128((const __m128i *) p);
+		__m128i m = _mm_or_si128(
+			_mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(v, c0), _mm_cmpeq_epi8(v, c1)),
+				_mm_or_si128(_mm_cmpeq_epi8(v, c2), _mm_cmpeq_epi8(v, c3))),
+			_mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(v, c4), _mm_cmpeq_epi8(v, c5)),
+				_mm_or_si128(_mm_cmpeq_epi8(v, c6), _mm_cmpeq_epi8(v, c7))));
+		int mask = _mm_movemask_epi8(m);
+		if ( mask )
+			return p + __builtin_ctz(mask);
+		p += 16;
+		}
+	return scan_bytes(p, end);
+}
+#endif
+
+#ifdef HAVE_AVX2
+__attribute__((target("avx2")))
+static const char *scan_avx2(const char *p, const char *end)
+{
+	const __m256i c0 = _mm256_set1_epi8('\0'), c1 = _mm256_set1_epi8('\n');
+	const __m256i c2 = _mm256_set1_epi8('\\'), c3 = _mm256_set1_epi8('`');
+	const __m256i c4 = _mm256_set1_epi8('*'), c5 = _mm256_set1_epi8('_');
+	const __m256i c6 = _mm256_set1_epi8('['), c7 = _mm256_set1_epi8('!');
+
+	while ( end - p >= 32 ) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) p);
+		__m256i m = _mm256_or_si256(
+			_mm256_or_si256(
+				_mm256_or_si256(_mm256_cmpeq_epi8(v, c0), _mm256_cmpeq_epi8(v, c1)),
+				_mm256_or_si256(_mm256_cmpeq_epi8(v, c2), _mm256_cmpeq_epi8(v, c3))),
+			_mm256_or_si256(
+				_mm256_or_si256(_mm256_cmpeq_epi8(v, c4), _mm256_cmpeq_epi8(v, c5)),
+				_mm256_or_si256(_mm256_cmpeq_epi8(v, c6), _mm256_cmpeq_epi8(v, c7))));
+		unsigned mask = (unsigned) _mm256_movemask_epi8(m);
+		if ( mask )
+			return p + __builtin_ctz(mask);
+		p += 32;
+		}
+	return scan_bytes(p, end);
+}
+#endif
+
+#ifdef HAVE_NEON
+static const char *scan_neon(const char *p, const char *end)
+{
+	const uint8x16_t c0 = vdupq_n_u8('\0'), c1 = vdupq_n_u8('\n');
+	const uint8x16_t c2 = vdupq_n_u8('\\'), c3 = vdupq_n_u8('`');
+	const uint8x16_t c4 = vdupq_n_u8('*'), c5 = vdupq_n_u8('_');
+	const uint8x16_t c6 = vdupq_n_u8('['), c7 = vdupq_n_u8('!');
+
+	while ( end - p >= 16 ) {
+		uint8x16_t v = vld1q_u8((const uint8_t *) p);
+		uint8x16_t m = vorrq_u8(
+			vorrq_u8(
+				vorrq_u8(vceqq_u8(v, c0), vceqq_u8(v, c1)),
+				vorrq_u8(vceqq_u8(v, c2), vceqq_u8(v, c3))),
+			vorrq_u8(
+				vorrq_u8(vceqq_u8(v, c4), vceqq_u8(v, c5)),
+				vorrq_u8(vceqq_u8(v, c6), vceqq_u8(v, c7))));
+		uint64x2_t w = vreinterpretq_u64_u8(m);
+		if ( vgetq_lane_u64(w, 0) | vgetq_lane_u64(w, 1) )
+			break;
+		p += 16;
+		}
+	return scan_bytes(p, end);
+}
+#endif
+
+/*
+ * the scanner of code-block lines; returns the first byte in [p, end)
+ * that ocode() escapes, a backslash, a new-line before '.' or '\'' or
+ * a byte that is not ASCII, or end, and adds the new-lines before it to
+ * 'lines'.
+ */
+static const char *scan_code(const char *p, const char *end, size_t *lines)
+{
+#ifdef HAVE_SSE2
+	const __m128i nl = _mm_set1_epi8('\n'), bs = _mm_set1_epi8('\\');
+	const __m128i dot = _mm_set1_epi8('.'), apos = _mm_set1_epi8('\'');
+
+	while ( end - p >= 17 ) { // and the byte after them
+		__m128i v = _mm_loadu_si128((const __m128i *) p);
+		__m128i w = _mm_loadu_si128((const __m128i *) (p + 1));
+		__m128i n = _mm_cmpeq_epi8(v, nl);
+		__m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, bs),
+			_mm_and_si128(n, _mm_or_si128(_mm_cmpeq_epi8(w, dot), _mm_cmpeq_epi8(w, apos))));
+		unsigned nmask = _mm_movemask_epi8(n), mask = _mm_movemask_epi8(_mm_or_si128(m, v));
+		if ( mask ) {
+			*lines += __builtin_popcount(nmask & ((1u << __builtin_ctz(mask)) - 1));
+			return p + __builtin_ctz(mask);
+			}
+		*lines += __builtin_popcount(nmask);
+		p += 16;
+		}
+#endif
+	for ( ; p < end; p ++ ) {
+		if ( *p == '\\' || (unsigned char) *p >= 0x80
+				|| (*p == '\n' && p + 1 < end && (p[1] == '.' || p[1] == '\'')) )
+			break;
+		if ( *p == '\n' )
+			(*lines) ++;
+		}
+	return p;
+}
+
+/*
+ * writes the code-block lines [p, end) as text, in spans between the
+ * bytes roff would read; backslashes become \e, and lines that start with
+ * a control character ('.' or '\'') get a \& before it.
+ * returns the number of lines.
+ */
+static size_t ocode(out_t *o, const char *p, const char *end)
+{
+	const char *q;
+	size_t	lines = ( p < end && end[-1] != '\n' ); // the last one is not terminated
+
+	if ( p < end && (*p == '.' || *p == '\'') )
+		owrite(o, "\\&", 2);
+	while ( (q = scan_code(p, end, &lines)) < end ) {
+		if ( *q == '\\' ) {
+			owrite(o, p, q - p);
+			oputc(o, '\\');
+			oputc(o, 'e');
+			p = q + 1;
+			}
+		else if ( *q == '\n' ) {
+			lines ++;
+			owrite(o, p, q + 1 - p);
+			oputc(o, '\\');
+			oputc(o, '&');
+			p = q + 1;
+			}
+		else {
+			owrite(o, p, q - p);
+			p = oglyph(o, q, end);
+			}
+		}
+	owrite(o, p, end - p);
+	return lines;
+}
+
+/*
+ * returns the scanner for this CPU
+ */
+static scan_t pickscan(void)
+{
+#ifdef HAVE_AVX2
+	__builtin_cpu_init();
+	if ( __builtin_cpu_supports("avx2") )
+		return scan_avx2;
+#endif
+#if defined(HAVE_SSE2)
+	return scan_sse2;
+#elif defined(HAVE_NEON)
+	return scan_neon;
+#else
+	return scan_swar;
+#endif
+}
+
+/*
+*	types of elements
+*/
+enum { none,
+		par_end, ln_brk,
+		cblock_end, cblock_open,
+		li_open, li_end,
+		ol_open, ul_open, lst_close,
+		man_ref, ol, ul,
+		bq_open, bq_close,
+		box_open, box_close,
+		url_mark, img_mark,
+		new_sh, new_ss, new_s4,
+		tbl_open, tbl_head, tbl_close,
+		fn_open, fn_item, fn_close,
+		elem_count };
+
+// names of the elements, for the statistics
+static const char *elem_names[] = {
+	"none",
+	"par_end", "ln_brk",
+	"cblock_end", "cblock_open",
+	"li_open", "li_end",
+	"ol_open", "ul_open", "lst_close",
+	"man_ref", "ol", "ul",
+	"bq_open", "bq_close",
+	"box_open", "box_close",
+	"url_mark", "img_mark",
+	"new_sh", "new_ss", "new_s4",
+	"tbl_open", "tbl_head", "tbl_close",
+	"fn_open", "fn_item", "fn_close",
+	};
+
+// md2roff_stats has a counter for each element
+typedef char elem_check[(elem_count == MD2ROFF_ELEMENTS
+	&& sizeof(elem_names) / sizeof(elem_names[0]) == elem_count) ? 1 : -1];
+
+#define	MAX_LIST_DEPTH	32	// default deepest list
+
+// an open list
+typedef struct {
+	int		type;		// ol or ul
+	int		count;		// counter of item
+	int		indent;		// columns before the markers of its items
+	} list_t;
+
+typedef struct block block_t;
+
+// a cell of a table, a span of the source
+typedef struct {
+	size_t	start, len;
+	} cell_t;
+
+// a column of a table
+typedef struct {
+	char	align;		// 'l', 'c' or 'r'
+	bool	fill;		// the cells are filled in a text block of 'width'
+	size_t	width;		// the widest cell, in characters
+	} column_t;
+
+typedef struct section section_t;
+
+// a definition of a reference link or of a footnote, spans of the source
+typedef struct {
+	const char	*label, *text;	// the id ("^id" for a footnote), and the url or the note
+	int			llen, tlen;
+	int			note;			// number of the footnote, 0 for a link
+	} def_t;
+
+// an entry of the hash table of the definitions
+typedef struct {
+	uint32_t	hash;		// of the label, compared before it
+	uint32_t	def;		// index + 1 of the definition, 0 for a free slot
+	} defslot_t;
+
+// the definitions of a document
+typedef struct {
+	def_t		*def;		// in the order of the document
+	size_t		ndef, defalloc;
+	defslot_t	*slot;		// hash table of 'nslot' entries, a power of 2
+	size_t		nslot;
+	int			notes;		// footnotes
+	uint64_t	hash;		// of all of them, 0 if there are none
+	} defs_t;
+
+typedef struct backend backend_t;
+
+// the inline pass, one for each package
+typedef bool (*inline_t)(md2roff_ctx *ctx, const char *source, const char *p, const char *pend);
+
+// X-macro of the packages, for the code that is made for each one
+#define	PACKAGES(X)	X(mm) X(man) X(mdoc) X(mom)
+
+static const inline_t	inliners[mp_mom + 1];	// defined after the inline pass
+
+/*
+*	converter context;
+*	all the state of one conversion, so each thread can have its own.
+*	the buffers are kept between documents, so a context that converts
+*	many files grows them once and reuses them.
+*/
+struct md2roff_ctx {
+	macropackage_t	mpack;		// output macro package
+	const backend_t	*be;		// and its backend
+	inline_t		inl;		// and its inline pass
+	scan_t			scan;		// finds the next special character
+	char			date[32];	// date of the default header, empty for today
+	md2roff_imagefn	imagefn;	// finds the files of the images, NULL uses them as written
+	void			*imagearg;
+
+	// list (enumeration/itemize) stack
+	list_t	*stk_list;		// 'stk_size' entries
+	int		stk_list_p;		// top pointer, always points to first free
+	int		stk_size;
+	int		maxdepth;		// deepest list
+	
+	strbuf_t	line;		// the output line buffer
+	out_t		out;		// the output writer
+
+	// block index of the chunk
+	block_t		*blk;
+	size_t		nblk, blkalloc;
+
+	// definitions of the document, and the ones that are used,
+	// 'defs' or the ones of the context of the whole document
+	defs_t			defs;
+	const defs_t	*refs;
+
+	// cells and columns of the current table
+	cell_t		*cell;
+	size_t		cellalloc;
+	column_t	*col;
+	size_t		colalloc;
+
+	arena_t		arena;		// scratch memory of the conversion
+	md2roff_ctx	**pool;		// contexts of the chunks of a parallel conversion
+	int			npool;
+
+	// sections of the last document, for incremental conversion
+	section_t	*sect;		// hash table, 'sectsize' is a power of 2
+	size_t		nsect, sectsize;
+	bool		incremental;
+
+	// the ']' and ')' of links that textend() found last
+	seek_t		seekb, seekp;
+
+	// parser state, kept between the chunks of a stream
+	bool	bline, bcode;		// at beginning of line, inside code-block
+	bool	bold, italics;		// inside strong, emphasis
+	bool	started;			// the preamble is written
+	bool	failed;				// the document is invalid
+	bool	cutspan;			// a code span or link may continue after the chunk
+	bool	quiet;				// do not report invalid documents
+	bool	timing;				// measure the times of 'stats'
+	bool	compact;			// drop the redundant requests, see ocompact()
+	int		nthreads;			// threads for one document
+
+	md2roff_stats	stats;		// counters of the conversions
+
+	// streaming input
+	strbuf_t	name;		// the document name
+	strbuf_t	in;			// input that is not converted yet
+	size_t		scanned;	// bytes of 'in' searched for a block end
+	bool		infence;	// the search is inside a code-block
+	};
+
+/*
+*	a roff string with its length, computed at compile time
+*/
+typedef struct {
+	const char	*s;
+	size_t		n;
+	} rstr_t;
+
+#define	RS(lit)		{ lit, sizeof(lit) - 1 }
+
+static inline void orstr(out_t *o, const rstr_t *r)
+{
+	if ( r->n ) // unset ones are NULL
+		owrite(o, r->s, r->n);
+}
+
+/*
+*	macro package backend;
+*	'req' is the fixed roff code of each element, elements whose code
+*	depends on their arguments or on the state have an 'emit' callback
+*	instead. a new package is one more entry in backends[].
+*/
+typedef void (*emit_t)(md2roff_ctx *ctx, va_list ap);
+
+struct backend {
+	rstr_t	req[elem_count];
+	emit_t	emit[elem_count];
+
+	// inline fonts
+	rstr_t	bold, italics, font_prev, code_open, code_close;
+
+	// if set, #### headers are written as is and closed with this
+	rstr_t	s4_close;
+
+	// the requests that md2roff_setcompact() drops
+	compact_t	compact;
+
+	// format of the images the package loads, MD2ROFF_EPS or MD2ROFF_PDF
+	int		image;
+
+	// writes the document header, returns where the text starts;
+	// after the title line if 'title' is set and the document has one
+	const char *(*preamble)(md2roff_ctx *ctx, const char *docname,
+		const char *p, const char *pend);
+	bool	title;
+	};
+
+/*
+*	--- elements with arguments ---
+*
+*	strings are passed as (pointer, int length) spans of the source,
+*	url_mark: title, title-length, link, link-length
+*	img_mark: text, text-length, file, width, height (in points, 0 if unknown)
+*	man_ref:  page, page-length
+*	fn_item:  number of the footnote
+*/
+static void man_url_mark(md2roff_ctx *ctx, va_list ap)
+{
+	const char	*title = va_arg(ap, const char *);
+	int			tlen = va_arg(ap, int);
+	const char	*link = va_arg(ap, const char *);
+	int			llen = va_arg(ap, int);
+
+	bool		mail = memchr(link, '@', llen) != NULL;
+
+	ostr(&ctx->out, ( mail ) ? ".MT " : ".UR ");
+	oescape(&ctx->out, link, llen);
+	oputc(&ctx->out, '\n');
+	oescape(&ctx->out, title, tlen);
+	ostr(&ctx->out, ( mail ) ? "\n.ME\n" : "\n.UE\n");
+}
+
+static void mdoc_url_mark(md2roff_ctx *ctx, va_list ap)
+{
+	const char	*title = va_arg(ap, const char *);
+	int			tlen = va_arg(ap, int);
+	const char	*link = va_arg(ap, const char *);
+	int			llen = va_arg(ap, int);
+
+	if ( memchr(link, '@', llen) ) {
+		ostr(&ctx->out, ".An ");
+		oescape(&ctx->out, title, tlen);
+		ostr(&ctx->out, " Aq Mt ");
+		oescape(&ctx->out, link, llen);
+		oputc(&ctx->out, '\n');
+		}
+	else {
+		ostr(&ctx->out, ".Lk ");
+		oescape(&ctx->out, link, llen);
+		ostr(&ctx->out, " \"");
+		oescape(&ctx->out, title, tlen);
+		ostr(&ctx->out, "\"\n");
+		}
+}
+
+static void mm_url_mark(md2roff_ctx *ctx, va_list ap) // there is no such thing...
+{
+	const char	*title = va_arg(ap, const char *);
+	int			tlen = va_arg(ap, int);
+	const char	*link = va_arg(ap, const char *);
+	int			llen = va_arg(ap, int);
+
+	oescape(&ctx->out, title, tlen);
+	ostr(&ctx->out, " <");
+	oescape(&ctx->out, link, llen);
+	ostr(&ctx->out, ">\n");
+}
+
+static void mom_url_mark(md2roff_ctx *ctx, va_list ap)
+{
+	const char	*title = va_arg(ap, const char *);
+	int			tlen = va_arg(ap, int);
+	const char	*link = va_arg(ap, const char *);
+	int			llen = va_arg(ap, int);
+
+	oescape(&ctx->out, title, tlen);
+	ostr(&ctx->out, " \\*[UL]");
+	oescape(&ctx->out, link, llen);
+	ostr(&ctx->out, "\\*[ULX]\n");
+}
+
+// .PSPIC of man, mdoc and mm, that nroff cannot show; it writes the text
+static void pspic_img_mark(md2roff_ctx *ctx, va_list ap)
+{
+	const char	*text = va_arg(ap, const char *);
+	int			tlen = va_arg(ap, int);
+	const char	*file = va_arg(ap, const char *);
+	int			w = va_arg(ap, int);
+	int			h = va_arg(ap, int);
+
+	ostr(&ctx->out, ".ie t .PSPIC ");
+	oarg(&ctx->out, file, strlen(file));
+	if ( w > 0 && h > 0 )
+		oprintf(&ctx->out, " %dp %dp", w, h);
+	ostr(&ctx->out, "\n.el \\&[");
+	oescape(&ctx->out, text, tlen);
+	ostr(&ctx->out, "]\n");
+}
+
+// .PDF_IMAGE needs the size, without it the text is written
+static void mom_img_mark(md2roff_ctx *ctx, va_list ap)
+{
+	const char	*text = va_arg(ap, const char *);
+	int			tlen = va_arg(ap, int);
+	const char	*file = va_arg(ap, const char *);
+	int			w = va_arg(ap, int);
+	int			h = va_arg(ap, int);
+
+	if ( w > 0 && h > 0 ) {
+		ostr(&ctx->out, ".PDF_IMAGE ");
+		oarg(&ctx->out, file, strlen(file));
+		oprintf(&ctx->out, " %dp %dp\n", w, h);
+		}
+	else {
+		ostr(&ctx->out, "\\&[");
+		oescape(&ctx->out, text, tlen);
+		ostr(&ctx->out, "]\n");
+		}
+}
+
+static void man_man_ref(md2roff_ctx *ctx, va_list ap)
+{
+	const char	*link = va_arg(ap, const char *);
+	int			llen = va_arg(ap, int);
+	const char	*p = memchr(link, ' ', llen);
+
+	ostr(&ctx->out, "\\fB");
+	oarg(&ctx->out, link, ( p ) ? p - link : llen);
+	ostr(&ctx->out, "\\fP");
+	if ( p ) {
+		oputc(&ctx->out, '(');
+		oarg(&ctx->out, p + 1, llen - (p - link) - 1);
+		oputc(&ctx->out, ')');
+		}
+	oputc(&ctx->out, '\n');
+}
+
+static void mdoc_man_ref(md2roff_ctx *ctx, va_list ap)
+{
+	const char	*link = va_arg(ap, const char *);
+	int			llen = va_arg(ap, int);
+	const char	*p = memchr(link, ' ', llen);
+
+	// mdoc reads a leading '.' of an argument as punctuation, so the \& stays
+	ostr(&ctx->out, ".Xr ");
+	oescape(&ctx->out, link, ( p ) ? p - link : llen);
+	if ( p ) {
+		oputc(&ctx->out, ' ');
+		oescape(&ctx->out, p + 1, llen - (p - link) - 1);
+		}
+	oputc(&ctx->out, '\n');
+}
+
+static void text_man_ref(md2roff_ctx *ctx, va_list ap)
+{
+	const char	*link = va_arg(ap, const char *);
+	int			llen = va_arg(ap, int);
+
+	oescape(&ctx->out, link, llen);
+	oputc(&ctx->out, '\n');
+}
+
+/*
+*	--- elements that depend on the list stack ---
+*/
+static void mom_ol_open(md2roff_ctx *ctx, va_list ap)
+{
+	static const rstr_t style[] = {
+		RS(".LIST DIGIT\n"), RS(".LIST ALPHA\n"),
+		RS(".LIST DIGIT\n"), RS(".LIST alpha\n") };
+	int level = ctx->stk_list_p;
+
+	(void) ap;
+	orstr(&ctx->out, &style[(level - 1) % 4]);
+}
+
+static void mom_ul_open(md2roff_ctx *ctx, va_list ap)
+{
+	(void) ap;
+	ostr(&ctx->out, (ctx->stk_list_p % 2) ? ".LIST BULLET\n" : ".LIST DASH\n");
+}
+
+static void mdoc_ul_open(md2roff_ctx *ctx, va_list ap)
+{
+	(void) ap;
+	ostr(&ctx->out, (ctx->stk_list_p % 2)
+		? ".Bl -bullet -offset indent\n" : ".Bl -dash -offset indent\n");
+}
+
+static void man_li_open(md2roff_ctx *ctx, va_list ap)
+{
+	int top = ctx->stk_list_p - 1;
+
+	(void) ap;
+	if ( top >= 0 ) {
+		if ( ctx->stk_list[top].type == ul )
+			ostr(&ctx->out, ".IP \\(bu 4\n");
+		else {
+			oprintf(&ctx->out, ".IP %d. 4\n", ctx->stk_list[top].count);
+			ctx->stk_list[top].count ++;
+			}
+		}
+}
+
+// the items of a list inside an item are indented
+static void man_lst_open(md2roff_ctx *ctx, va_list ap)
+{
+	(void) ap;
+	if ( ctx->stk_list_p > 1 )
+		ostr(&ctx->out, ".RS\n");
+}
+
+static void man_lst_close(md2roff_ctx *ctx, va_list ap)
+{
+	(void) ap;
+	if ( ctx->stk_list_p > 1 )
+		ostr(&ctx->out, ".RE\n");
+}
+
+static void man_fn_item(md2roff_ctx *ctx, va_list ap)
+{
+	oprintf(&ctx->out, ".IP [%d] 6\n", va_arg(ap, int));
+}
+
+static void mdoc_fn_item(md2roff_ctx *ctx, va_list ap)
+{
+	oprintf(&ctx->out, ".It [%d]\n", va_arg(ap, int));
+}
+
+static void mm_fn_item(md2roff_ctx *ctx, va_list ap)
+{
+	oprintf(&ctx->out, ".LI [%d]\n", va_arg(ap, int));
+}
+
+static void mom_fn_item(md2roff_ctx *ctx, va_list ap)
+{
+	oprintf(&ctx->out, ".PP\n[%d]\n", va_arg(ap, int));
+}
+
+/*
+*	--- document headers ---
+*/
+// true if the document 'p' starts with a '# ' title line
+static inline bool hastitle(const char *p, const char *pend)
+{
+	return pend - p > 1 && *p == '#' && isclass(*(p+1), C_SPACE);
+}
+
+static const char *th_preamble(md2roff_ctx *ctx, const char *docname,
+		const char *p, const char *pend)
+{
+	if ( hastitle(p, pend) ) {
+		ostr(&ctx->out, ".TH ");
+		p = println(&ctx->out, p+2, pend);
+		}
+	else if ( ctx->date[0] )
+		oprintf(&ctx->out, ".TH %s 7 %s document\n", docname, ctx->date);
+	else {
+		time_t tt = time(0);   // get time now
+		struct tm t;
+		localtime_r(&tt, &t);
+		oprintf(&ctx->out, ".TH %s 7 %d-%02d-%02d document\n",
+			   docname,
+			   t.tm_year+1900, t.tm_mon+1, t.tm_mday);
+		}
+	return p;
+}
+
+static const char *man_preamble(md2roff_ctx *ctx, const char *docname,
+		const char *p, const char *pend)
+{
+	oputs(&ctx->out, ".do mso man.tmac"); // Linux man
+	return th_preamble(ctx, docname, p, pend);
+}
+
+static const char *mdoc_preamble(md2roff_ctx *ctx, const char *docname,
+		const char *p, const char *pend)
+{
+	oputs(&ctx->out, ".do mso mdoc.tmac"); // BSD man
+	return th_preamble(ctx, docname, p, pend);
+}
+
+static const char *mm_preamble(md2roff_ctx *ctx, const char *docname,
+		const char *p, const char *pend)
+{
+	(void) docname; (void) pend;
+	oputs(&ctx->out, ".do mso m.tmac"); // mm package, AL BL DL LI LE
+	return p;
+}
+
+static const char *mom_preamble(md2roff_ctx *ctx, const char *docname,
+		const char *p, const char *pend)
+{
+	(void) pend;
+	oputs(&ctx->out, ".do mso mom.tmac"); // mom
+	oprintf(&ctx->out, ".TITLE \"%s\"\n", docname);
+	ostr(&ctx->out, ".AUTHOR \"md2roff\"\n");
+	ostr(&ctx->out, ".PAPER A4\n");
+	ostr(&ctx->out, ".PRINTSTYLE TYPESET\n");
+	ostr(&ctx->out, ".START\n");
+	return p;
+}
+
+/*
+*	the backends, indexed by macropackage_t
+*/
+static const backend_t backends[] = {
+	[mp_mm] = {
+		.req = {
+			[par_end] = RS(".PP\n"),
+			[ln_brk] = RS(".br\n"),
+			[box_open] = RS(".FT B\n"),
+			[box_close] = RS(".FT P\n"),
+			[cblock_open] = RS(".RS 4\n.EX\n"),
+			[cblock_end] = RS("\n.EE\n.RE\n"),
+			[ol_open] = RS(".AL\n"),
+			[ul_open] = RS(".BL\n"),
+			[li_open] = RS(".LI\n"),
+			[lst_close] = RS(".LE\n"),
+			[new_sh] = RS(".SH "),
+			[new_ss] = RS(".SS "),
+			[new_s4] = RS(".SS "),
+			[tbl_open] = RS(".TS H\n"),	// the header is repeated on each page
+			[tbl_head] = RS(".TH\n"),
+			[tbl_close] = RS(".TE\n"),
+			[fn_open] = RS(".SH FOOTNOTES\n.VL 6\n"),
+			[fn_close] = RS(".LE\n"),
+			},
+		.emit = {
+			[url_mark] = mm_url_mark,
+			[img_mark] = pspic_img_mark,
+			[man_ref] = text_man_ref,
+			[fn_item] = mm_fn_item,
+			},
+		.bold = RS("\\fB"), .italics = RS("\\fI"), .font_prev = RS("\\fP"),
+		.code_open = RS("`\\f[CR]"), .code_close = RS("\\fP'"),
+		.compact = {
+			.par = ".PP\n",
+			.starts = { ".PP", ".SH", ".SS" },
+			.empty = { ".SH ", ".SS " },
+			},
+		.image = MD2ROFF_EPS,
+		.preamble = mm_preamble,
+		},
+	[mp_man] = {
+		.req = {
+			[par_end] = RS(".PP\n"),
+			[ln_brk] = RS(".br\n"),
+			[box_open] = RS(".B\n"),
+			[box_close] = RS(".FT P\n"),
+			[cblock_open] = RS(".RS 4\n.EX\n"),
+			[cblock_end] = RS("\n.EE\n.RE\n"),
+			[new_sh] = RS(".SH "),
+			[new_ss] = RS(".SS "),
+			[new_s4] = RS(".TP\n\\fB"),
+			[tbl_open] = RS(".TS\n"),
+			[tbl_close] = RS(".TE\n"),
+			[fn_open] = RS(".SH FOOTNOTES\n"),
+			},
+		.emit = {
+			[url_mark] = man_url_mark,
+			[img_mark] = pspic_img_mark,
+			[man_ref] = man_man_ref,
+			[li_open] = man_li_open,
+			[ol_open] = man_lst_open,
+			[ul_open] = man_lst_open,
+			[lst_close] = man_lst_close,
+			[fn_item] = man_fn_item,
+			},
+		.bold = RS("\\fB"), .italics = RS("\\fI"), .font_prev = RS("\\fP"),
+		.code_open = RS("`\\f[CR]"), .code_close = RS("\\fP'"),
+		.s4_close = RS("\\fR"),
+		.compact = {
+			.par = ".PP\n",
+			.starts = { ".PP", ".SH", ".SS", ".IP", ".TP" },
+			.empty = { ".SH ", ".SS " },
+			},
+		.image = MD2ROFF_EPS,
+		.preamble = man_preamble, .title = true,
+		},
+	[mp_mdoc] = {
+		.req = {
+			[par_end] = RS(".Pp\n"),
+			[ln_brk] = RS(".br\n"),
+			[box_open] = RS(".FT B\n"),
+			[box_close] = RS(".FT P\n"),
+			[cblock_open] = RS(".Bd -literal -offset indent\n"),
+			[cblock_end] = RS(".Ed\n"),
+			[ol_open] = RS(".Bl -enum -offset indent\n"),
+			[lst_close] = RS(".El\n"),
+			[li_open] = RS(".It\n"),
+			[new_sh] = RS(".Sh "),
+			[new_ss] = RS(".Ss "),
+			[new_s4] = RS(".Ss "),
+			[tbl_open] = RS(".TS\n"),
+			[tbl_close] = RS(".TE\n"),
+			[fn_open] = RS(".Sh FOOTNOTES\n.Bl -tag -width 6n\n"),
+			[fn_close] = RS(".El\n"),
+			},
+		.emit = {
+			[url_mark] = mdoc_url_mark,
+			[img_mark] = pspic_img_mark,
+			[man_ref] = mdoc_man_ref,
+			[ul_open] = mdoc_ul_open,
+			[fn_item] = mdoc_fn_item,
+			},
+		.bold = RS("\\fB"), .italics = RS("\\fI"), .font_prev = RS("\\fP"),
+		.code_open = RS("`\\f[CR]"), .code_close = RS("\\fP'"),
+		.compact = {
+			.par = ".Pp\n",
+			.starts = { ".Pp", ".Sh", ".Ss" },
+			.empty = { ".Sh ", ".Ss " },
+			},
+		.image = MD2ROFF_EPS,
+		.preamble = mdoc_preamble, .title = true,
+		},
+	[mp_mom] = {
+		.req = {
+			[par_end] = RS(".PP\n"),
+			[ln_brk] = RS(".BR\n"),	// or .br or .EL or .LINEBREAK ????
+			[box_open] = RS(".DRH\n"),
+			[box_close] = RS(".DRH\n"),
+			[cblock_open] = RS(".CODE\n"),
+			[cblock_end] = RS(".CODE OFF\n"),
+			[lst_close] = RS(".LIST OFF\n"),
+			[li_open] = RS(".ITEM\n"),
+			[new_sh] = RS(".HEADING 1 \""),
+			[new_ss] = RS(".HEADING 2 \""),
+			[new_s4] = RS(".HEADING 3 \""),
+			[tbl_open] = RS(".TS\n"),
+			[tbl_close] = RS(".TE\n"),
+			[fn_open] = RS(".HEADING 1 \"Footnotes\"\n"),
+			},
+		.emit = {
+			[url_mark] = mom_url_mark,
+			[img_mark] = mom_img_mark,
+			[man_ref] = text_man_ref,
+			[ol_open] = mom_ol_open,
+			[ul_open] = mom_ul_open,
+			[fn_item] = mom_fn_item,
+			},
+		.bold = RS("\\*[BD]"), .italics = RS("\\*[IT]"), .font_prev = RS("\\*[PREV]"),
+		.code_open = RS("`\\*[CODE]"), .code_close = RS("\\*[CODE OFF]'"),
+		.compact = {
+			.par = ".PP\n",
+			.starts = { ".PP", ".HEADING" },
+			.empty = { ".HEADING 1 \"", ".HEADING 2 \"", ".HEADING 3 \"" },
+			},
+		.image = MD2ROFF_PDF,
+		.preamble = mom_preamble,
+		},
+	};
+
+/*
+*	creates a context for the package 'mp'
+*/
+md2roff_ctx *md2roff_new(macropackage_t mp)
+{
+	md2roff_ctx *ctx = (md2roff_ctx *) xrealloc(NULL, sizeof(md2roff_ctx));
+
+	memset(ctx, 0, sizeof(md2roff_ctx));
+	md2roff_setpackage(ctx, mp);
+	ctx->scan = pickscan();
+	ctx->nthreads = 1;
+	ctx->maxdepth = MAX_LIST_DEPTH;
+	ctx->refs = &ctx->defs;
+	return ctx;
+}
+
+/*
+*	releases the context 'ctx' and its buffers
+*/
+void md2roff_delete(md2roff_ctx *ctx)
+{
+	if ( ctx ) {
+		free(ctx->line.data);
+		free(ctx->out.own.data);
+		free(ctx->name.data);
+		free(ctx->in.data);
+		free(ctx->blk);
+		free(ctx->cell);
+		free(ctx->col);
+		free(ctx->defs.def);
+		free(ctx->defs.slot);
+		free(ctx->stk_list);
+		arfree(&ctx->arena);
+		for ( int i = 0; i < ctx->npool; i ++ )
+			md2roff_delete(ctx->pool[i]);
+		free(ctx->pool);
+		md2roff_setincremental(ctx, false);
+		free(ctx);
+		}
+}
+
+/*
+*	selects the macro package of 'ctx'
+*/
+void md2roff_setpackage(md2roff_ctx *ctx, macropackage_t mp)
+{
+	ctx->mpack = mp;
+	ctx->be = &backends[mp];
+	ctx->inl = inliners[mp];
+}
+
+/*
+*	sets the date of the default header; NULL for the current date
+*/
+void md2roff_setdate(md2roff_ctx *ctx, const char *date)
+{
+	snprintf(ctx->date, sizeof(ctx->date), "%s", ( date ) ? date : "");
+}
+
+/*
+*	sets the callback that finds the files of the images
+*/
+void md2roff_setimages(md2roff_ctx *ctx, md2roff_imagefn fn, void *arg)
+{
+	ctx->imagefn = fn;
+	ctx->imagearg = arg;
+}
+
+/*
+*	sets the deepest list nesting of 'ctx'; 0 for the default
+*/
+void md2roff_setlistdepth(md2roff_ctx *ctx, int depth)
+{
+	ctx->maxdepth = ( depth > 0 ) ? depth : MAX_LIST_DEPTH;
+}
+
+/*
+*	measures the times of the statistics of 'ctx', or not
+*/
+void md2roff_settiming(md2roff_ctx *ctx, int on)
+{
+	ctx->timing = on;
+}
+
+/*
+*	drops the redundant requests of the output, or not; see md2roff.h
+*/
+void md2roff_setcompact(md2roff_ctx *ctx, int on)
+{
+	ctx->compact = on;
+}
+
+/*
+*	returns the counters of the conversions of 'ctx'
+*/
+const md2roff_stats *md2roff_getstats(const md2roff_ctx *ctx)
+{
+	return &ctx->stats;
+}
+
+/*
+*	zeroes the counters of 'ctx'
+*/
+void md2roff_resetstats(md2roff_ctx *ctx)
+{
+	memset(&ctx->stats, 0, sizeof(md2roff_stats));
+}
+
+/*
+*	returns the name of the element 'el' of md2roff_stats.roff, or NULL
+*/
+const char *md2roff_element(int el)
+{
+	return ( el >= 0 && el < elem_count ) ? elem_names[el] : NULL;
+}
+
+/*
+*	returns the macro package of 'ctx'
+*/
+macropackage_t md2roff_package(const md2roff_ctx *ctx)
+{
+	return ctx->mpack;
+}
+
+/*
+*	returns the time in seconds, if 'ctx' measures it, otherwise 0
+*/
+static double mdclock(const md2roff_ctx *ctx)
+{
+	struct timespec	ts;
+
+	if ( !ctx->timing )
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+*	adds the counters of the conversion of a chunk 'src' to 'dst'
+*/
+static void addstats(md2roff_stats *dst, const md2roff_stats *src)
+{
+	dst->scan += src->scan;
+	dst->render += src->render;
+	dst->lines += src->lines;
+	dst->links += src->links;
+	dst->code_lines += src->code_lines;
+	if ( src->list_depth > dst->list_depth )
+		dst->list_depth = src->list_depth;
+	for ( int i = 0; i < elem_count; i ++ )
+		dst->roff[i] += src->roff[i];
+}
+
+/*
+*	makes room for 'n' lists in the stack of 'ctx'
+*/
+static void lstgrow(md2roff_ctx *ctx, int n)
+{
+	if ( n > ctx->stk_size ) {
+		int size = ( ctx->stk_size ) ? ctx->stk_size : 8;
+		while ( size < n )
+			size *= 2;
+		ctx->stk_list = (list_t *) xrealloc(ctx->stk_list, size * sizeof(list_t));
+		ctx->stk_size = size;
+		}
+}
+
+/*
+*	write the roff code of 'type'; see the backend
+*/
+static void roff(md2roff_ctx *ctx, int type, ...)
+{
+	const backend_t *be = ctx->be;
+
+	ctx->stats.roff[type] ++;
+	if ( type == ol_open || type == ul_open ) {
+		lstgrow(ctx, ctx->stk_list_p + 1);
+		ctx->stk_list[ctx->stk_list_p].type = ( type == ol_open ) ? ol : ul;
+		ctx->stk_list[ctx->stk_list_p].count = 1;
+		ctx->stk_list[ctx->stk_list_p].indent = 0;
+		ctx->stk_list_p ++;
+		if ( ctx->stk_list_p > ctx->stats.list_depth )
+			ctx->stats.list_depth = ctx->stk_list_p;
+		}
+
+	if ( be->emit[type] ) {
+		va_list	ap;
+		va_start(ap, type);
+		be->emit[type](ctx, ap);
+		va_end(ap);
+		}
+	else
+		orstr(&ctx->out, &be->req[type]);
+}
+
+/*
+ *  write buffer and reset;
+ *  a line that would start with a control character gets a \& before it
+ */
+static void flushln(md2roff_ctx *ctx)
+{
+	strbuf_t *b = &ctx->line;
+
+	if ( b->len ) {
+		bool utf8;
+		size_t n = sqzln(b->data, b->len, &utf8);
+		if ( n ) {
+			if ( isclass(*b->data, C_CTRL) )
+				owrite(&ctx->out, "\\&", 2);
+			if ( utf8 )
+				otext(&ctx->out, b->data, n);
+			else
+				owrite(&ctx->out, b->data, n);
+			oputc(&ctx->out, '\n');
+			ctx->stats.lines ++;
+			}
+		b->len = 0;
+		}
+}
+
+/*
+ *	resets the parser state, for the start of a document
+ */
+static void mdstart(md2roff_ctx *ctx)
+{
+	ctx->stk_list_p = 0; // reset stack
+	ctx->line.len = 0;
+	ctx->bline = true;
+	ctx->bcode = ctx->bold = ctx->italics = false;
+	ctx->started = ctx->failed = ctx->cutspan = false;
+}
+
+/*
+ *	forgets the definitions of the last document
+ */
+static void mdnodefs(md2roff_ctx *ctx)
+{
+	ctx->defs.ndef = 0;
+	ctx->defs.notes = 0;
+	ctx->defs.hash = 0;
+	if ( ctx->defs.slot )
+		memset(ctx->defs.slot, 0, ctx->defs.nslot * sizeof(defslot_t));
+	ctx->refs = &ctx->defs;
+}
+
+/*
+ *	starts a new document; resets the parser state and the definitions
+ */
+static void mdbegin(md2roff_ctx *ctx)
+{
+	mdnodefs(ctx);
+	mdstart(ctx);
+	oputs(&ctx->out, ".\\\" x-roff document");
+}
+
+/*
+ *	--- block index ---
+ *
+ *	the document is converted in two passes; the first one splits it in
+ *	blocks, and the second one writes each block, formatting its text
+ *	inline. the records point into the source; the index is kept in the
+ *	context.
+ */
+enum { blk_text,		// inline text, lines of a paragraph
+		blk_blank,		// empty line, ends the paragraph and the list
+		blk_break,		// ends the output line
+		blk_header,		// header of 'level'; its line, or none if the text follows inline
+		blk_box,		// '# ... #' line
+		blk_ul,			// item of unordered list, its text follows
+		blk_ol,			// item 'num' of ordered list, its text follows
+		blk_fence,		// ``` opens code-block
+		blk_code,		// lines of code-block
+		blk_fence_end,	// ``` closes code-block, the rest of the line follows
+		blk_setext,		// '===' or '---' line under text, section
+		blk_table };	// rows of a table of 'num' columns
+
+struct block {
+	unsigned char	type;		// blk_*
+	unsigned char	level;		// header level, 4 for all the deeper ones; indent of item
+	int				num;		// number of item
+	size_t			start;		// offset of its text in the source
+	size_t			len;		// and length
+	};
+
+/*
+ *	adds a block of 'type' with the text [p, end) to the index;
+ *	text, and code lines, that follow the previous block of the
+ *	same type are joined with it.
+ */
+static block_t *addblk(md2roff_ctx *ctx, int type, const char *source, const char *p, const char *end)
+{
+	block_t *b;
+
+	if ( ctx->nblk ) {
+		b = &ctx->blk[ctx->nblk - 1];
+		if ( b->type == type && (type == blk_text || type == blk_code)
+				&& b->start + b->len == (size_t) (p - source) ) {
+			b->len += end - p;
+			return b;
+			}
+		}
+	if ( ctx->nblk == ctx->blkalloc ) {
+		ctx->blkalloc = ( ctx->blkalloc ) ? ctx->blkalloc * 2 : 256;
+		ctx->blk = (block_t *) xrealloc(ctx->blk, ctx->blkalloc * sizeof(block_t));
+		}
+	b = &ctx->blk[ctx->nblk ++];
+	b->type = type;
+	b->level = 0;
+	b->num = 0;
+	b->start = p - source;
+	b->len = end - p;
+	return b;
+}
+
+/*
+ *	returns the end of the inline text at 'p', its '\n' or 'pend'.
+ *	code spans and links may continue on the next lines; they are
+ *	skipped as mdinline() reads them.
+ */
+static const char *textend(md2roff_ctx *ctx, const char *p, const char *pend)
+{
+	const char *q, *r;
+
+	while ( (p = ctx->scan(p, pend)) < pend ) {
+		switch ( *p ) {
+		case '\n':
+			return p;
+		case '\\':
+			if ( ++ p == pend ) {
+				ctx->cutspan = true;
+				return pend;
+				}
+			p ++;
+			break;
+		case '`':
+			q = memchr(p + 1, '`', pend - (p + 1));
+			if ( q == NULL ) { // not closed, mdinline() reports it
+				ctx->cutspan = true;
+				return pend;
+				}
+			p = q + 1;
+			break;
+		case '!':
+			if ( !(p + 1 < pend && *(p+1) == '[') ) {
+				if ( p + 1 == pend )
+					ctx->cutspan = true;
+				p ++;
+				break;
+				}
+			p ++;
+			// fall through
+		case '[':
+			q = seekchr(&ctx->seekb, p + 1, pend, ']');
+			if ( q && q + 1 < pend && *(q+1) == '('
+					&& (r = seekchr(&ctx->seekp, q + 2, pend, ')')) != NULL )
+				p = r + 1;
+			else {
+				if ( q == NULL || q + 1 == pend || *(q+1) == '(' )
+					ctx->cutspan = true; // the rest of the link may follow
+				p ++;
+				}
+			break;
+		default:
+			p ++;
+			}
+		}
+	return pend;
+}
+
+/*
+ *	--- tables ---
+ *
+ *	GFM pipe tables: a row of headers, a row of '-' with the alignment
+ *	of each column, and the rows of cells, up to a blank line or a line
+ *	without '|'. the cells of a row are split at the '|' that are not
+ *	escaped; a leading and a trailing '|' are optional.
+ */
+
+/*
+ *	trims the row [*p, *end) to its cells, the text between the blanks
+ *	and the leading and trailing '|'
+ */
+static void tblrow(const char **p, const char **end)
+{
+	const char *s = *p, *e = *end;
+
+	while ( s < e && isclass(*s, C_SPACE) ) s ++;
+	while ( e > s && isclass(*(e - 1), C_SPACE) ) e --;
+	if ( s < e && *s == '|' )
+		s ++;
+	if ( e > s && *(e - 1) == '|' && !(e - 1 > s && *(e - 2) == '\\') )
+		e --;
+	*p = s;
+	*end = e;
+}
+
+/*
+ *	returns the end of the cell at 'p' of a trimmed row, its '|' or 'end'
+ */
+static const char *tblcell(const char *p, const char *end)
+{
+	for ( ; p < end && *p != '|'; p ++ )
+		if ( *p == '\\' && p + 1 < end )
+			p ++;
+	return p;
+}
+
+/*
+ *	trims the blanks around [*p, *end)
+ */
+static void trimblanks(const char **p, const char **end)
+{
+	while ( *p < *end && isclass(**p, C_SPACE) ) (*p) ++;
+	while ( *end > *p && isclass(*(*end - 1), C_SPACE) ) (*end) --;
+}
+
+/*
+ *	returns the alignment of the delimiter cell [p, end), or 0 if it is not
+ */
+static int tblalign(const char *p, const char *end)
+{
+	bool	left, right;
+
+	trimblanks(&p, &end);
+	if ( (left = ( p < end && *p == ':' )) )
+		p ++;
+	if ( (right = ( end > p && *(end - 1) == ':' )) )
+		end --;
+	if ( p == end )
+		return 0;
+	for ( ; p < end; p ++ )
+		if ( *p != '-' )
+			return 0;
+	return ( left && right ) ? 'c' : ( right ) ? 'r' : 'l';
+}
+
+/*
+ *	returns the number of cells of the row [p, end); or of its delimiter
+ *	cells, and 0 if one is not, if 'delim' is true.
+ */
+static int tblcount(const char *p, const char *end, bool delim)
+{
+	const char *e;
+	int		n = 0;
+
+	tblrow(&p, &end);
+	for ( ; ; p = e + 1 ) {
+		e = tblcell(p, end);
+		if ( delim && !tblalign(p, e) )
+			return 0;
+		n ++;
+		if ( e == end )
+			return n;
+		}
+}
+
+/*
+ *	if a table starts at the line 'p', returns its end, after the newline
+ *	of its last row, and its columns in 'ncols'; otherwise NULL.
+ */
+static const char *tblend(const char *p, const char *pend, int *ncols)
+{
+	const char *e, *d, *de;
+
+	if ( (e = memchr(p, '\n', pend - p)) == NULL || memchr(p, '|', e - p) == NULL )
+		return NULL;
+	for ( d = e + 1; d < pend && (*d == ' ' || *d == '\t'); d ++ )
+		;
+	if ( d == pend || (*d != '|' && *d != ':' && *d != '-') )
+		return NULL;
+	de = memchr(d, '\n', pend - d);
+	de = ( de ) ? de : pend;
+	if ( (*ncols = tblcount(d, de, true)) == 0 || tblcount(p, e, false) != *ncols )
+		return NULL;
+	for ( p = de; p < pend; p = e ) {
+		const char *q = p + 1;
+		e = memchr(q, '\n', pend - q);
+		e = ( e ) ? e : pend;
+		if ( memchr(q, '|', e - q) == NULL )
+			break;
+		}
+	return ( p < pend ) ? p + 1 : pend;
+}
+
+/*
+ *	--- definitions ---
+ *
+ *	reference links, "[id]: url", and footnotes, "[^id]: text" and the
+ *	indented lines after it, may be defined anywhere in the document, so
+ *	they are indexed before the conversion: one pass over the lines puts
+ *	their spans in an open addressing table, and the inline pass finds
+ *	each reference in O(1). ids are compared without case; the first
+ *	definition of an id is kept. footnotes are numbered in the order of
+ *	their definitions and written at the end of the document.
+ */
+#define	lower(c)	(( (c) >= 'A' && (c) <= 'Z' ) ? (c) - 'A' + 'a' : (c))
+
+/*
+ *	hash of the label 'p' of 'len' bytes, without case
+ */
+static uint32_t hashlabel(const char *p, int len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	for ( ; len; p ++, len -- )
+		h = (h ^ (unsigned char) lower(*p)) * 0x100000001b3ULL;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	return h >> 32;
+}
+
+/*
+ *	returns the slot of the definition of the label 'p' of 'len' bytes,
+ *	and 'hash', in 'd', or the free slot where it goes
+ */
+static defslot_t *defslot(const defs_t *d, const char *p, int len, uint32_t hash)
+{
+	size_t	i = hash & (d->nslot - 1);
+
+	for ( ;; i = (i + 1) & (d->nslot - 1) ) {
+		defslot_t *e = &d->slot[i];
+		const def_t *def;
+		int		j;
+
+		if ( e->def == 0 )
+			return e;
+		if ( e->hash != hash )
+			continue;
+		def = &d->def[e->def - 1];
+		if ( def->llen == len ) {
+			for ( j = 0; j < len && lower(def->label[j]) == lower(p[j]); j ++ )
+				;
+			if ( j == len )
+				return e;
+			}
+		}
+}
+
+/*
+ *	returns the definition of the label 'p' of 'len' bytes, or NULL
+ */
+static const def_t *finddef(const defs_t *d, const char *p, int len)
+{
+	defslot_t *e;
+
+	if ( d->ndef == 0 )
+		return NULL;
+	e = defslot(d, p, len, hashlabel(p, len));
+	return ( e->def ) ? &d->def[e->def - 1] : NULL;
+}
+
+/*
+ *	adds the definition 'def' to the context, unless its label is
+ *	defined; with 'copy', its spans are copied to the arena, for the
+ *	input of a stream that is not kept.
+ */
+static void adddef(md2roff_ctx *ctx, def_t *def, bool copy)
+{
+	defs_t		*d = &ctx->defs;
+	defslot_t	*e, *old = d->slot;
+	size_t		i, n = d->nslot;
+	uint32_t	hash = hashlabel(def->label, def->llen);
+
+	if ( (d->ndef + 1) * 2 > d->nslot ) { // rebuild the table, twice as large
+		d->nslot = ( n ) ? n * 2 : 64;
+		d->slot = (defslot_t *) xrealloc(NULL, d->nslot * sizeof(defslot_t));
+		memset(d->slot, 0, d->nslot * sizeof(defslot_t));
+		for ( i = 0; i < n; i ++ ) { // the labels are different, only the hash is needed
+			if ( old[i].def ) {
+				size_t j = old[i].hash & (d->nslot - 1);
+				while ( d->slot[j].def )
+					j = (j + 1) & (d->nslot - 1);
+				d->slot[j] = old[i];
+				}
+			}
+		free(old);
+		}
+	e = defslot(d, def->label, def->llen, hash);
+	if ( e->def )
+		return;
+	if ( copy ) {
+		char *m = (char *) aralloc(&ctx->arena, def->llen + def->tlen);
+		memcpy(m, def->label, def->llen);
+		memcpy(m + def->llen, def->text, def->tlen);
+		def->label = m;
+		def->text = m + def->llen;
+		}
+	def->note = ( *def->label == '^' ) ? ++ d->notes : 0;
+	if ( d->ndef == d->defalloc ) {
+		d->defalloc = ( d->defalloc ) ? d->defalloc * 2 : 64;
+		d->def = (def_t *) xrealloc(d->def, d->defalloc * sizeof(def_t));
+		}
+	d->def[d->ndef ++] = *def;
+	e->hash = hash;
+	e->def = d->ndef;
+	d->hash = (d->hash ^ hashmem(def->label, def->llen)) * 0x100000001b3ULL
+		^ hashmem(def->text, def->tlen);
+}
+
+/*
+ *	if a definition starts at 'p', the '[' of a line, returns its end,
+ *	after its last newline, and its spans in 'def'; otherwise NULL.
+ */
+static const char *defend(const char *p, const char *pend, def_t *def)
+{
+	const char *l = p + 1, *le, *t, *te, *nl;
+
+	nl = memchr(l, '\n', pend - l); // the label is on the line
+	nl = ( nl ) ? nl : pend;
+	if ( (le = memchr(l, ']', nl - l)) == NULL || le + 1 == pend || *(le+1) != ':'
+			|| le == l || (*l == '^' && le == l + 1) )
+		return NULL;
+	t = le + 2;
+	te = nl;
+	if ( *l == '^' ) { // footnote, it continues on the indented lines
+		while ( nl + 1 < pend && (*(nl+1) == ' ' || *(nl+1) == '\t') ) {
+			const char *q = nl + 1, *e = memchr(q, '\n', pend - q);
+
+			e = ( e ) ? e : pend;
+			trimblanks(&q, &e);
+			if ( q == e ) // blank
+				break;
+			te = e;
+			nl = memchr(e, '\n', pend - e);
+			nl = ( nl ) ? nl : pend;
+			}
+		trimblanks(&t, &te);
+		}
+	else { // link, the url, in <> or up to a blank; a title may follow
+		trimblanks(&t, &te);
+		if ( t < te && *t == '<' && (p = memchr(t, '>', te - t)) != NULL )
+			t ++;
+		else
+			for ( p = t; p < te && !isclass(*p, C_SPACE); p ++ ) ;
+		te = p;
+		if ( t == te )
+			return NULL;
+		}
+	def->label = l;
+	def->llen = le - l;
+	def->text = t;
+	def->tlen = te - t;
+	return ( nl < pend ) ? nl + 1 : pend;
+}
+
+/*
+ *	indexes the definitions of the lines [p, pend); 'copy' as adddef()
+ */
+static void mddefs(md2roff_ctx *ctx, const char *p, const char *pend, bool copy)
+{
+	const char *q, *e;
+	bool	fence = false;
+	def_t	def;
+
+	while ( p < pend ) {
+		for ( q = p; q < pend && q - p < 3 && *q == ' '; q ++ ) ;
+		if ( isprefix(p, pend, "```") )
+			fence = !fence;
+		else if ( !fence && q < pend && *q == '[' && (e = defend(q, pend, &def)) != NULL ) {
+			adddef(ctx, &def, copy);
+			p = e;
+			continue;
+			}
+		e = memchr(p, '\n', pend - p);
+		p = ( e ) ? e + 1 : pend;
+		}
+}
+
+/*
+ *	if "[text][id]", "[text][]", "[text]" or "[^id]" at 'p' is a defined
+ *	reference, returns its end, its definition in 'def' and the length of
+ *	its text in 'tlen'
+ */
+static const char *reflink(const md2roff_ctx *ctx, seek_t *rb, const char *p, const char *pend,
+		const def_t **def, int *tlen)
+{
+	const char *close = seekchr(rb, p + 1, pend, ']'), *label = p + 1, *end;
+
+	if ( close == NULL )
+		return NULL;
+	*tlen = close - label;
+	end = close + 1;
+	if ( end < pend && *end == '[' ) {
+		const char *id = end + 1;
+		if ( (end = seekchr(rb, id, pend, ']')) == NULL )
+			return NULL;
+		if ( end > id ) {
+			label = id;
+			close = end;
+			}
+		end ++;
+		}
+	if ( close == label || (*def = finddef(ctx->refs, label, close - label)) == NULL )
+		return NULL;
+	return end;
+}
+
+/*
+ *	first pass; indexes the blocks from 'p' up to 'pstop' in 'ctx->blk',
+ *	the last one may continue to 'pend'. 'source' is the beginning of the
+ *	chunk. returns the end of the last block.
+ */
+static const char *mdblocks(md2roff_ctx *ctx, const char *source, const char *p,
+		const char *pstop, const char *pend)
+{
+	const backend_t *be = ctx->be;
+	const char *pnext;
+	bool	bline = ctx->bline, bcode = ctx->bcode;
+	block_t	*b;
+	def_t	def;
+	double	t = mdclock(ctx);
+
+	ctx->nblk = 0;
+	memset(&ctx->seekb, 0, sizeof(seek_t));
+	memset(&ctx->seekp, 0, sizeof(seek_t));
+	while ( p < pstop ) {
+
+		//////////////////////////////////
+		// inside code block
+		//////////////////////////////////
+		if ( bcode ) {
+			if ( isprefix(p, pend, "```") ) { // end of code-block
+				addblk(ctx, blk_fence_end, source, p, p);
+				p += 3;
+				bcode = false;
+				}
+			else { // all the lines up to the fence, or up to the first after 'pstop'
+				const char *stop = pstop;
+				if ( stop > p && *(stop-1) != '\n' ) {
+					stop = memchr(stop, '\n', pend - stop);
+					stop = ( stop ) ? stop + 1 : pend;
+					}
+				for ( pnext = p + 1; (pnext = memchr(pnext, '`', stop - pnext)) != NULL; pnext ++ )
+					if ( *(pnext-1) == '\n' && isprefix(pnext, pend, "```") )
+						break;
+				if ( pnext == NULL )
+					pnext = stop;
+				addblk(ctx, blk_code, source, p, pnext);
+				p = pnext;
+				}
+			continue;
+			}
+
+		//////////////////////////////////
+		// beginning of line, unless escaped
+		//////////////////////////////////
+		if ( bline && *p != '\\' ) {
+			const char *q = p; // the markers of list items may be indented
+			int	indent = 0, ncols;
+
+			bline = false;
+			for ( ; q < pend && (*q == ' ' || *q == '\t'); q ++ )
+				indent = ( *q == '\t' ) ? (indent / 4 + 1) * 4 : indent + 1;
+			if ( indent > UCHAR_MAX )
+				indent = UCHAR_MAX;
+
+			if ( *p == '\n' ) { // empty line
+				addblk(ctx, blk_blank, source, p, p + 1);
+				bline = true;
+				p ++;
+				continue;
+				}
+			else if ( indent < 4 && q < pend && *q == '[' && (pnext = defend(q, pend, &def)) != NULL ) {
+				p = pnext; // definition, indexed by mddefs()
+				bline = true;
+				continue;
+				}
+			else if ( (pnext = tblend(p, pend, &ncols)) != NULL ) { // table
+				b = addblk(ctx, blk_table, source, p, pnext);
+				b->num = ncols;
+				p = pnext;
+				bline = true;
+				continue;
+				}
+			else if ( *p == '#' ) { // header
+				pnext = memchr(p, '\n', pend - p);
+				if ( pnext == NULL ) // not a header, just ends the line
+					addblk(ctx, blk_break, source, p, p);
+				else if ( *(pnext-1) == '#' ) {
+					addblk(ctx, blk_box, source, p, pnext + 1);
+					p = pnext + 1;
+					continue;
+					}
+				else {
+					int	level = 0;
+					while ( *p == '#' ) { level ++; p ++; }
+					while ( *p == ' ' || *p == '\t' ) p ++;
+					b = addblk(ctx, blk_header, source, p, pnext + 1);
+					b->level = ( level < 4 ) ? level : 4;
+					if ( level < 4 || be->s4_close.n ) {
+						p = pnext + 1;
+						continue;
+						}
+					b->len = 0;	// the text is inline
+					}
+				}
+			else if ( q + 1 < pend && (*(q+1) == ' ' || *(q+1) == '\t')
+				&& (*q == '*' || *q == '+' || *q == '-') ) { // unordered list
+				b = addblk(ctx, blk_ul, source, q, q);
+				b->level = indent;
+				p = q + 1;
+				}
+			else if ( q < pend && isclass(*q, C_DIGIT) ) { // ordered list
+				char	num[16], *n;
+				const char *pstub = q;
+
+				n = num;
+				while ( q < pend && isclass(*q, C_DIGIT) && n < num + sizeof(num) - 1 )
+					*n ++ = *q ++;
+				*n = '\0';
+				if ( q < pend && *q == '.' ) {
+					b = addblk(ctx, blk_ol, source, pstub, pstub);
+					b->num = atoi(num);
+					b->level = indent;
+					p = q + 1;
+					while ( p < pend && (*p == ' ' || *p == '\t') ) p ++;
+					}
+				}
+			else if ( isprefix(p, pend, "```") ) { // open code-block
+				addblk(ctx, blk_fence, source, p, p);
+				bcode = true;
+				p += 3;
+				continue;
+				}
+			} // inside if ( beginning of line )
+
+		//////////////////////////////////
+		// text, up to the end of line
+		//////////////////////////////////
+		bline = false;
+		pnext = textend(ctx, p, pend);
+		if ( pnext == pend ) {
+			addblk(ctx, blk_text, source, p, pend);
+			p = pend;
+			}
+		else if ( isprefix(pnext+1, pend, "===")
+				|| isprefix(pnext+1, pend, "---")
+				|| isprefix(pnext+1, pend, "***") ) { // section or ruler
+			if ( pnext > p )
+				addblk(ctx, blk_text, source, p, pnext);
+			p = memchr(pnext + 1, '\n', pend - (pnext + 1));
+			p = ( p ) ? p + 1 : pend;
+			addblk(ctx, blk_setext, source, pnext + 1, p);
+			}
+		else {
+			if ( pend - pnext < 4 && (pnext + 1 == pend // the underline could follow
+					|| (strchr("=-*", *(pnext+1)) && (pnext + 2 == pend || *(pnext+2) == *(pnext+1)))) )
+				ctx->cutspan = true;
+			addblk(ctx, blk_text, source, p, pnext + 1);
+			p = pnext + 1;
+			bline = true;
+			}
+		}
+	ctx->bline = bline;
+	ctx->bcode = bcode;
+	ctx->stats.scan += mdclock(ctx) - t;
+	return p;
+}
+
+/*
+ *	writes the image 'file' with the alternate 'text'; the callback of
+ *	md2roff_setimages() gives the file the package loads and its size.
+ *	the title of ![text](file "title") is not written.
+ */
+static void mdimage(md2roff_ctx *ctx, const char *text, int tlen, const char *file, int flen)
+{
+	md2roff_image	img;
+	const char		*p = file;
+
+	while ( p < file + flen && !isclass(*p, C_SPACE) )
+		p ++;
+	img.src = file;
+	img.srclen = p - file;
+	img.format = ctx->be->image;
+	img.width = img.height = 0;
+	img.name[0] = '\0';
+	if ( !ctx->imagefn )
+		snprintf(img.name, sizeof(img.name), "%.*s", (int) img.srclen, file);
+	else if ( ctx->imagefn(ctx->imagearg, &img) != 0 || !img.name[0] ) {
+		sbputc(&ctx->line, '[');
+		sbnesc(&ctx->line, text, tlen);
+		sbputc(&ctx->line, ']');
+		return;
+		}
+	roff(ctx, img_mark, text, tlen, img.name, img.width, img.height);
+}
+
+/*
+ *	formats the inline text [p, pend) to the output line with the
+ *	backend 'be'; 'source' is the beginning of the chunk.
+ *	returns false if the document is invalid.
+ *	it is instantiated for each package below, so the strings of 'be'
+ *	are constants in the loop.
+ */
+static ALWAYS_INLINE bool mdinline_be(md2roff_ctx *ctx, const backend_t *be,
+		const char *source, const char *p, const char *pend)
+{
+	const char *pnext, *pstart;
+	const def_t *def;
+	int		tlen;
+	strbuf_t *d = &ctx->line;
+	bool	bold = ctx->bold, italics = ctx->italics;
+	seek_t	rb = { NULL, NULL }, rp = { NULL, NULL };	// the ']' and ')' of the links
+
+	while ( p < pend ) {
+
+		//////////////////////////////////
+		// ignore escape characters
+		if ( *p == '\\' ) {
+			if ( ++ p == pend )
+				break;
+			switch (*p) {
+			case 'n': sbputc(d, '\n'); break;
+			case 'r': sbputc(d, '\r'); break;
+			case 't': sbputc(d, '\t'); break;
+			case 'f': sbputc(d, '\f'); break;
+			case 'b': sbputc(d, '\b'); break;
+			case 'a': sbputc(d, '\a'); break;
+			case 'e': sbputc(d, '\033'); break;
+			case '\\': sbnadd(d, "\\e", 2); break;
+			default:
+				sbputc(d, *p);
+				}
+			p ++;
+			continue;
+			}
+
+		if ( *p == '\n' ) // end of line, the next one continues the text
+			sbputc(d, ' ');
+		else if ( p + 1 < pend && (
+			( *p == '*' && *(p+1) == '*' ) ||
+			( *p == '_' && *(p+1) == '_' ) ) ) { // strong
+			if ( bold ) {
+				bold = false;
+				sbnadd(d, be->font_prev.s, be->font_prev.n);
+				}
+			else {
+				char pc = (p > source) ? *(p-1) : ' ';
+				if ( isclass(pc, C_EMPH) || utf8emph(source, p) ) {
+					bold = true;
+					sbnadd(d, be->bold.s, be->bold.n);
+					}
+				else {
+					sbputc(d, *p);
+					sbputc(d, *(p+1));
+					}
+				}
+			p += 2;
+			continue;
+			}
+		else if ( *p == '*' ||  *p == '_' ) { // emphasis
+			if ( italics ) {
+				italics = false;
+				sbnadd(d, be->font_prev.s, be->font_prev.n);
+				}
+			else {
+				char pc = (p > source) ? *(p-1) : ' ';
+				if ( isclass(pc, C_EMPH) || utf8emph(source, p) ) {
+					italics = true;
+					sbnadd(d, be->italics.s, be->italics.n);
+					}
+				else
+					sbputc(d, *p);
+				}
+			p ++;
+			continue;
+			}
+		else if ( *p == '`' ) { // inline code
+			p ++;
+			sbnadd(d, be->code_open.s, be->code_open.n);
+			
+			pnext = memchr(p, '`', pend - p);
+			if ( pnext == NULL ) {
+				if ( !ctx->quiet )
+					fprintf(stderr, "%s", "inline code (`) didnt closed.");
+				flushln(ctx);
+				oflush(&ctx->out);
+				ctx->failed = true;
+				return false;
+				}
+			sbnesc(d, p, pnext - p);
+			p = pnext;
+
+			sbnadd(d, be->code_close.s, be->code_close.n);
+			}
+
+		//
+		//	Markdown link:
+		//
+		//	generic link syntax  [text](link)
+		//	image link syntax	![text](link)
+		//	man page syntax      [page section](man)
+		//
+		else if ( *p == '[' || (*p == '!' && p + 1 < pend && *(p+1) == '[') ) { // markdown link
+			const char *pfin;
+			bool bimg = false;
+			if ( *p == '!' ) {
+				p ++;
+				bimg = true;
+				}
+			pstart = p + 1;
+			pnext = seekchr(&rb, pstart, pend, ']');
+			if ( pnext && pnext + 1 < pend
+					 && ( *(pnext+1) == '(' )
+						 && ((pfin = seekchr(&rp, pnext+2, pend, ')')) != NULL)
+			   ) {
+				// spans inside 'source', [pstart, pnext) and [pnext+2, pfin)
+				int left = pnext - pstart;
+				int rght = pfin - (pnext + 2);
+
+				flushln(ctx);
+				ctx->stats.links ++;
+				
+				if ( bimg )
+					mdimage(ctx, pstart, left, pnext + 2, rght);
+				else if ( rght == 3 && strncmp(pnext + 2, "man", 3) == 0 )
+					roff(ctx, man_ref, pstart, left);
+				else
+					roff(ctx, url_mark, pstart, left, pnext + 2, rght);
+				
+				// finish
+				p = pfin + 1;
+				continue;
+				}
+			else if ( (pnext = reflink(ctx, &rb, p, pend, &def, &tlen)) != NULL ) { // reference link or footnote
+				if ( def->note ) {
+					char	mark[16];
+					sbnadd(d, mark, snprintf(mark, sizeof(mark), "[%d]", def->note));
+					}
+				else {
+					flushln(ctx);
+					ctx->stats.links ++;
+					if ( bimg )
+						mdimage(ctx, pstart, tlen, def->text, def->tlen);
+					else if ( def->tlen == 3 && strncmp(def->text, "man", 3) == 0 )
+						roff(ctx, man_ref, pstart, tlen);
+					else
+						roff(ctx, url_mark, pstart, tlen, def->text, def->tlen);
+					}
+				p = pnext;
+				continue;
+				}
+			else {
+				sbputc(d, *p ++);
+				continue;
+				}
+			}
+		else if ( *p ) { // plain text, copy it up to the next special character
+			pnext = ctx->scan(p + 1, pend);
+			sbnadd(d, p, pnext - p);
+			p = pnext;
+			continue;
+			}
+
+		p ++; // '\0' is not valid in roff text
+		}
+	ctx->bold = bold;
+	ctx->italics = italics;
+	return true;
+}
+
+// the inline pass of each package, selected by md2roff_setpackage()
+#define	INLINE_FN(mp) \
+	static bool mdinline_##mp(md2roff_ctx *ctx, const char *source, const char *p, const char *pend) \
+	{ return mdinline_be(ctx, &backends[mp_##mp], source, p, pend); }
+#define	INLINE_ENTRY(mp)	[mp_##mp] = mdinline_##mp,
+
+PACKAGES(INLINE_FN)
+
+static const inline_t inliners[mp_mom + 1] = { PACKAGES(INLINE_ENTRY) };
+
+/*
+ *	formats the inline text [p, pend) with the package of 'ctx'; see
+ *	mdinline_be()
+ */
+static inline bool mdinline(md2roff_ctx *ctx, const char *source, const char *p, const char *pend)
+{
+	return ctx->inl(ctx, source, p, pend);
+}
+
+/*
+ *	closes the lists deeper than 'depth'
+ */
+static void lstclose(md2roff_ctx *ctx, int depth)
+{
+	while ( ctx->stk_list_p > depth ) {
+		roff(ctx, li_end);
+		roff(ctx, lst_close);
+		ctx->stk_list_p --;
+		}
+}
+
+/*
+ *	ends the previous item of a list, and the lists indented more than
+ *	'indent', before an item of 'indent'; opens a list of 'type' (ol_open
+ *	or ul_open) if the item starts one, inside the previous item if it is
+ *	indented more, up to the deepest nesting.
+ */
+static void lstitem(md2roff_ctx *ctx, int type, int indent)
+{
+	int		top;
+
+	while ( ctx->stk_list_p > 1 && ctx->stk_list[ctx->stk_list_p - 1].indent > indent )
+		lstclose(ctx, ctx->stk_list_p - 1);
+	top = ctx->stk_list_p - 1;
+	if ( top < 0 || (indent > ctx->stk_list[top].indent && ctx->stk_list_p < ctx->maxdepth) ) {
+		roff(ctx, type);
+		ctx->stk_list[ctx->stk_list_p - 1].indent = indent;
+		}
+	else
+		roff(ctx, li_end);
+}
+
+/*
+ *	writes the text of the cell [p, end); code spans and the fonts are
+ *	formatted as in the paragraphs, the fonts end with the cell.
+ */
+static void tbltext(md2roff_ctx *ctx, const char *p, const char *end)
+{
+	const backend_t *be = ctx->be;
+	const char *q, *start = p;
+	const char *c = ( end - p > 1 && *p == '\\' ) ? p + 1 : p; // the first character, unescaped
+	bool	bold = false, italics = false;
+
+	if ( end - c == 1 && (*c == '_' || *c == '=') ) { // tbl reads it as a rule
+		owrite(&ctx->out, "\\&", 2);
+		oputc(&ctx->out, *c);
+		return;
+		}
+	if ( c < end && isclass(*c, C_CTRL) )
+		owrite(&ctx->out, "\\&", 2);
+	while ( p < end ) {
+		if ( *p == '\\' && p + 1 < end ) { // escaped, "\|" is the '|' of the text
+			p ++;
+			if ( isclass(*p, C_ROFF) )
+				owrite(&ctx->out, "\\e", 2);
+			else
+				oputc(&ctx->out, *p);
+			p ++;
+			}
+		else if ( *p == '`' && (q = memchr(p + 1, '`', end - (p + 1))) != NULL ) {
+			orstr(&ctx->out, &be->code_open);
+			for ( p ++; p < q; p ++ ) {
+				if ( isclass(*p, C_ROFF) )
+					owrite(&ctx->out, "\\e", 2);
+				else
+					oputc(&ctx->out, ( *p == '\t' ) ? ' ' : *p);
+				}
+			orstr(&ctx->out, &be->code_close);
+			p ++;
+			}
+		else if ( *p == '*' || *p == '_' ) {
+			bool	strong = ( p + 1 < end && *(p+1) == *p ), *on = ( strong ) ? &bold : &italics;
+
+			if ( *on ) {
+				*on = false;
+				orstr(&ctx->out, &be->font_prev);
+				}
+			else if ( p == start || isclass(*(p-1), C_EMPH) || utf8emph(start, p) ) {
+				*on = true;
+				orstr(&ctx->out, ( strong ) ? &be->bold : &be->italics);
+				}
+			else
+				owrite(&ctx->out, p, ( strong ) ? 2 : 1);
+			p += ( strong ) ? 2 : 1;
+			}
+		else if ( *p == '\t' ) { // it separates the cells
+			oputc(&ctx->out, ' ');
+			p ++;
+			}
+		else if ( *p == '\\' ) { // the last character
+			owrite(&ctx->out, "\\e", 2);
+			p ++;
+			}
+		else {
+			for ( q = p + 1; q < end && *q != '\\' && *q != '`' && *q != '*'
+					&& *q != '_' && *q != '\t'; q ++ )
+				;
+			otext(&ctx->out, p, q - p);
+			p = q;
+			}
+		}
+	if ( bold )
+		orstr(&ctx->out, &be->font_prev);
+	if ( italics )
+		orstr(&ctx->out, &be->font_prev);
+}
+
+/*
+ *	writes one row of cells; the cells of columns that are filled are
+ *	text blocks
+ */
+static void tblline(md2roff_ctx *ctx, const char *source, const cell_t *cell, int ncols)
+{
+	for ( int i = 0; i < ncols; i ++ ) {
+		const char *p = source + cell[i].start;
+
+		if ( i )
+			oputc(&ctx->out, '\t');
+		if ( ctx->col[i].fill ) {
+			ostr(&ctx->out, "T{\n");
+			tbltext(ctx, p, p + cell[i].len);
+			ostr(&ctx->out, "\nT}");
+			}
+		else
+			tbltext(ctx, p, p + cell[i].len);
+		}
+	oputc(&ctx->out, '\n');
+}
+
+/*
+ *	writes the table [p, pend) of 'ncols' columns as a tbl(1) block.
+ *
+ *	one pass over the rows indexes the cells, as spans of the source, and
+ *	finds the alignment and the widest cell of each column; if the table
+ *	is wider than the line, the wide columns share what the narrow ones
+ *	leave and they are filled. missing cells are empty, and the cells past
+ *	the columns are dropped.
+ */
+#define	TBL_WIDTH		72	// characters of the line
+#define	TBL_GAP			3	// between the columns
+#define	TBL_MIN_FILL	10	// the narrowest filled column
+
+static void mdtable(md2roff_ctx *ctx, const char *source, const char *p, const char *pend, int ncols)
+{
+	const char *nl, *e, *c, *ce;
+	size_t	rows = 0, row = 0, total = 0, narrow = 0, nwide = 0, share;
+	int		i;
+	bool	more;
+
+	if ( (size_t) ncols > ctx->colalloc ) {
+		ctx->colalloc = ncols;
+		ctx->col = (column_t *) xrealloc(ctx->col, ncols * sizeof(column_t));
+		}
+	for ( ; p < pend; p = ( nl < pend ) ? nl + 1 : pend ) {
+		const char *r = p;
+
+		nl = memchr(p, '\n', pend - p);
+		nl = e = ( nl ) ? nl : pend;
+		tblrow(&r, &e);
+		if ( row ++ == 1 ) { // the delimiter row
+			for ( i = 0, c = r; i < ncols; i ++, c = ce + ( ce < e ) ) {
+				ce = tblcell(c, e);
+				ctx->col[i].align = tblalign(c, ce);
+				}
+			continue;
+			}
+		if ( (rows + 1) * ncols > ctx->cellalloc ) {
+			ctx->cellalloc = ( ctx->cellalloc ) ? ctx->cellalloc * 2 : 256;
+			while ( ctx->cellalloc < (rows + 1) * ncols )
+				ctx->cellalloc *= 2;
+			ctx->cell = (cell_t *) xrealloc(ctx->cell, ctx->cellalloc * sizeof(cell_t));
+			}
+		for ( i = 0, c = r, more = true; i < ncols; i ++ ) {
+			cell_t *cell = &ctx->cell[rows * ncols + i];
+			const char *t = c, *te;
+			size_t	width = 0;
+
+			if ( !more ) // the row has less cells
+				cell->start = cell->len = 0;
+			else {
+				te = ce = tblcell(c, e);
+				trimblanks(&t, &te);
+				cell->start = t - source;
+				cell->len = te - t;
+				for ( ; t < te; t ++ ) // UTF-8 continuation bytes are not characters
+					width += ( (*t & 0xC0) != 0x80 );
+				if ( (more = ( ce < e )) )
+					c = ce + 1;
+				}
+			if ( rows == 0 || width > ctx->col[i].width )
+				ctx->col[i].width = width;
+			}
+		rows ++;
+		}
+
+	// the columns that are filled
+	share = TBL_WIDTH / ncols;
+	for ( i = 0; i < ncols; i ++ ) {
+		total += ctx->col[i].width + TBL_GAP;
+		if ( ctx->col[i].width > share )
+			nwide ++;
+		else
+			narrow += ctx->col[i].width + TBL_GAP;
+		}
+	if ( total > TBL_WIDTH + TBL_GAP && nwide ) {
+		share = ( narrow + nwide * TBL_MIN_FILL < TBL_WIDTH ) ? (TBL_WIDTH - narrow) / nwide - TBL_GAP : TBL_MIN_FILL;
+		if ( share < TBL_MIN_FILL )
+			share = TBL_MIN_FILL;
+		}
+	for ( i = 0; i < ncols; i ++ ) {
+		ctx->col[i].fill = ( total > TBL_WIDTH + TBL_GAP && ctx->col[i].width > share );
+		if ( ctx->col[i].fill )
+			ctx->col[i].width = share;
+		}
+
+	// the format of the header, bold, and of the rows
+	roff(ctx, tbl_open);
+	for ( row = 0; row < 2; row ++ ) {
+		for ( i = 0; i < ncols; i ++ ) {
+			if ( i )
+				oputc(&ctx->out, ' ');
+			oputc(&ctx->out, ctx->col[i].align);
+			if ( row == 0 )
+				oputc(&ctx->out, 'b');
+			if ( ctx->col[i].fill )
+				oprintf(&ctx->out, "w(%zun)", ctx->col[i].width);
+			}
+		ostr(&ctx->out, ( row == 0 ) ? "\n" : ".\n");
+		}
+	tblline(ctx, source, ctx->cell, ncols);
+	ostr(&ctx->out, "_\n");
+	roff(ctx, tbl_head);
+	for ( size_t r = 1; r < rows; r ++ )
+		tblline(ctx, source, ctx->cell + r * ncols, ncols);
+	roff(ctx, tbl_close);
+}
+
+/*
+ *	second pass; writes the blocks of the index.
+ *	returns false if the document is invalid.
+ */
+static bool mdrender(md2roff_ctx *ctx, const char *source)
+{
+	const backend_t *be = ctx->be;
+	const block_t *b, *bend = ctx->blk + ctx->nblk;
+	const char *p, *pend;
+	double	t = mdclock(ctx);
+
+	for ( b = ctx->blk; b < bend; b ++ ) {
+		p = source + b->start;
+		pend = p + b->len;
+		switch ( b->type ) {
+		case blk_text:
+			if ( !mdinline(ctx, source, p, pend) ) {
+				ctx->stats.render += mdclock(ctx) - t;
+				return false;
+				}
+			break;
+		case blk_blank:
+			flushln(ctx);
+			lstclose(ctx, 0);
+			roff(ctx, par_end);
+			break;
+		case blk_break:
+			flushln(ctx);
+			break;
+		case blk_header:
+			flushln(ctx);
+			switch ( b->level ) {
+			case 1: roff(ctx, new_sh); break; // TH?
+			case 2: roff(ctx, new_sh); break;
+			case 3: roff(ctx, new_ss); break;
+			default:
+				roff(ctx, new_s4);
+				if ( be->s4_close.n ) {
+					println(&ctx->out, p, pend);
+					orstr(&ctx->out, &be->s4_close);
+					}
+				continue;
+				}
+			println(&ctx->out, p, pend);
+			break;
+		case blk_box:
+			flushln(ctx);
+			roff(ctx, box_open);
+			roff(ctx, ln_brk);
+			println(&ctx->out, p, pend);
+			roff(ctx, ln_brk);
+			roff(ctx, box_close);
+			break;
+		case blk_ul:
+			flushln(ctx);
+			lstitem(ctx, ul_open, b->level);
+			roff(ctx, li_open);
+			break;
+		case blk_ol:
+			flushln(ctx);
+			lstitem(ctx, ol_open, b->level);
+			ctx->stk_list[ctx->stk_list_p-1].count = b->num;
+			roff(ctx, li_open);
+			break;
+		case blk_fence:
+			flushln(ctx);
+			roff(ctx, cblock_open);
+			break;
+		case blk_code:
+			ctx->stats.code_lines += ocode(&ctx->out, p, pend);
+			break;
+		case blk_fence_end:
+			flushln(ctx);
+			roff(ctx, cblock_end);
+			flushln(ctx);
+			break;
+		case blk_table:
+			flushln(ctx);
+			mdtable(ctx, source, p, pend, b->num);
+			break;
+		case blk_setext:
+			if ( ctx->line.len ) { // the text before is the section title
+				roff(ctx, new_sh);
+				flushln(ctx);
+				}
+			break;
+			}
+		}
+	ctx->stats.render += mdclock(ctx) - t;
+	return true;
+}
+
+/*
+ *	this converts the next 'len' bytes of the document (they do not need
+ *	to be terminated), to *-roff; the first chunk starts with the document
+ *	header. the state between chunks is kept in 'ctx'.
+ *	returns false if the document is invalid.
+ */
+static bool md2roff(md2roff_ctx *ctx, const char *docname, const char *source, size_t len)
+{
+	const char *p = source, *pend = source + len;
+
+	if ( !ctx->started ) {
+		p = ctx->be->preamble(ctx, docname, p, pend);
+		ctx->started = true;
+		}
+	mdblocks(ctx, source, p, pend, pend);
+	return mdrender(ctx, source);
+}
+
+/*
+ *	ends the document, after its last block; writes the footnotes
+ */
+static void mdfinish(md2roff_ctx *ctx)
+{
+	const defs_t *d = &ctx->defs;
+
+	flushln(ctx);
+	lstclose(ctx, 0);
+	if ( d->notes == 0 )
+		return;
+	roff(ctx, fn_open);
+	for ( size_t i = 0; i < d->ndef; i ++ ) {
+		const def_t *e = &d->def[i];
+		if ( e->note ) {
+			roff(ctx, fn_item, e->note);
+			ctx->bold = ctx->italics = false;
+			if ( !mdinline(ctx, e->text, e->text, e->text + e->tlen) )
+				return;
+			if ( ctx->bold || ctx->italics ) // the fonts end with the note
+				sbnadd(&ctx->line, ctx->be->font_prev.s, ctx->be->font_prev.n);
+			flushln(ctx);
+			}
+		}
+	roff(ctx, fn_close);
+}
+
+/*
+ *	returns the status of the conversion, as md2roff_convert()
+ */
+static int mdstatus(md2roff_ctx *ctx)
+{
+	if ( ctx->out.err ) {
+		errno = ctx->out.err;
+		return -1;
+		}
+	return ( ctx->failed ) ? -1 : 0;
+}
+
+/*
+ *	selects the output of 'ctx'
+ */
+static void mdsink(md2roff_ctx *ctx, const md2roff_sink *sink)
+{
+	if ( sink->fd == -1 )
+		outmem(&ctx->out, sink->mem);
+	else
+		outfd(&ctx->out, sink->fd);
+	if ( ctx->compact )
+		ctx->out.cpt = &ctx->be->compact;
+}
+
+/*
+ *	--- parallel conversion ---
+ *
+ *	a large document is cut in chunks after blank lines, and workers
+ *	convert them at the same time, each one as if it starts a paragraph
+ *	with no list, code-block or font open. then the chunks are taken in
+ *	order; a chunk is used if the conversion before it really ended
+ *	there in that state, and if no code span or link of the chunk ran to
+ *	its end. otherwise it is converted again after the previous, as the
+ *	serial conversion does, so the output is the same.
+ */
+#ifndef SPLIT_MIN
+#define	SPLIT_MIN		(256 * 1024)	// smallest chunk; the fuzzer makes it small
+#endif
+#define	SPLIT_PER_THREAD	4			// chunks per thread
+
+typedef struct {
+	const char	*start, *end;	// the chunk
+	md2roff_ctx	*ctx;			// its conversion and the state at its end
+	md2roff_buf	*res;			// its output, kept by 'ctx'
+	bool		last;			// it ends the document
+	bool		ok, done;
+	} chunk_t;
+
+typedef struct {
+	chunk_t		*chunks;
+	int			count, next;
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	} split_t;
+
+/*
+ *	true if the state of 'ctx' is the one that the chunks assume
+ */
+static bool mdclean(const md2roff_ctx *ctx)
+{
+	return ctx->bline && !ctx->bcode && !ctx->bold && !ctx->italics
+		&& ctx->stk_list_p == 0 && ctx->line.len == 0 && !ctx->failed;
+}
+
+/*
+ *	copies the parser state of 'src' to 'dst'
+ */
+static void mdstate(md2roff_ctx *dst, const md2roff_ctx *src)
+{
+	dst->bline = src->bline;
+	dst->bcode = src->bcode;
+	dst->bold = src->bold;
+	dst->italics = src->italics;
+	dst->stk_list_p = src->stk_list_p;
+	if ( src->stk_list_p ) {
+		lstgrow(dst, src->stk_list_p);
+		memcpy(dst->stk_list, src->stk_list, src->stk_list_p * sizeof(list_t));
+		}
+	dst->line.len = 0;
+	if ( src->line.len )
+		sbnadd(&dst->line, src->line.data, src->line.len);
+}
+
+/*
+ *	returns the context 'i' of the pool of 'ctx'; they are kept with
+ *	their buffers for the next documents.
+ */
+static md2roff_ctx *poolctx(md2roff_ctx *ctx, int i)
+{
+	if ( i == ctx->npool ) {
+		ctx->pool = (md2roff_ctx **) xrealloc(ctx->pool, (i + 1) * sizeof(md2roff_ctx *));
+		ctx->pool[ctx->npool ++] = md2roff_new(ctx->mpack);
+		}
+	md2roff_setpackage(ctx->pool[i], ctx->mpack);
+	ctx->pool[i]->timing = ctx->timing;
+	ctx->pool[i]->maxdepth = ctx->maxdepth;
+	ctx->pool[i]->refs = &ctx->defs;
+	ctx->pool[i]->imagefn = ctx->imagefn;
+	ctx->pool[i]->imagearg = ctx->imagearg;
+	return ctx->pool[i];
+}
+
+/*
+ *	converts the chunk [start, end) with the pool context 'w', to its
+ *	'out.own', as if it starts a paragraph with nothing open.
+ *	returns false if its output cannot be used; 'last' is true if the
+ *	chunk ends the document.
+ */
+static bool convchunk(md2roff_ctx *w, const char *start, const char *end, bool last)
+{
+	bool	ok;
+
+	memset(&w->stats, 0, sizeof(md2roff_stats));
+	w->out.own.len = 0;
+	outmem(&w->out, &w->out.own);
+	w->stk_list_p = 0;
+	w->line.len = 0;
+	w->bline = w->started = w->quiet = true;
+	w->bcode = w->bold = w->italics = w->failed = w->cutspan = false;
+	mdblocks(w, start, start, end, end);
+	ok = ( !w->cutspan || last ) && mdrender(w, start);
+	oflush(&w->out);
+	return ok;
+}
+
+/*
+ *	worker thread; converts the next chunk until there are no more
+ */
+static void *splitworker(void *arg)
+{
+	split_t	*sp = (split_t *) arg;
+	chunk_t	*c;
+
+	for ( ;; ) {
+		pthread_mutex_lock(&sp->lock);
+		c = ( sp->next < sp->count ) ? &sp->chunks[sp->next ++] : NULL;
+		pthread_mutex_unlock(&sp->lock);
+		if ( c == NULL )
+			break;
+
+		c->ok = convchunk(c->ctx, c->start, c->end, c->last);
+
+		pthread_mutex_lock(&sp->lock);
+		c->done = true;
+		pthread_cond_broadcast(&sp->cond);
+		pthread_mutex_unlock(&sp->lock);
+		}
+	return NULL;
+}
+
+/*
+ *	converts the document 'source' as md2roff() with 'ctx->nthreads'
+ *	threads; the output is the same.
+ *	returns false if the document is invalid.
+ */
+static bool mdparallel(md2roff_ctx *ctx, const char *docname, const char *source, size_t len)
+{
+	const char *p = source, *pend = source + len, *pos;
+	split_t		sp;
+	chunk_t		*c;
+	pthread_t	*tid;
+	int			i, n, nthreads;
+	int			err = errno; // only write errors set it
+	bool		valid = true;
+
+	p = ctx->be->preamble(ctx, docname, p, pend);
+	ctx->started = true;
+
+	// cut after the first blank line that follows each 1/n of the text
+	n = ctx->nthreads * SPLIT_PER_THREAD;
+	if ( (size_t) (pend - p) / SPLIT_MIN < (size_t) n )
+		n = (pend - p) / SPLIT_MIN;
+	if ( n < 2 ) {
+		mdblocks(ctx, source, p, pend, pend);
+		return mdrender(ctx, source);
+		}
+	sp.chunks = (chunk_t *) aralloc(&ctx->arena, n * sizeof(chunk_t));
+	sp.count = 0;
+	for ( pos = p, i = 1; i <= n && pos < pend; i ++ ) {
+		const char *q = ( i == n ) ? pend : p + (pend - p) / n * i;
+		if ( q < pos )
+			q = pos;
+		while ( q < pend && (q = memchr(q, '\n', pend - q)) != NULL ) {
+			q ++;
+			if ( q < pend && *q == '\n' ) {
+				q ++;
+				break;
+				}
+			}
+		if ( q == NULL )
+			q = pend;
+		if ( q <= pos )
+			continue;
+		c = &sp.chunks[sp.count ++];
+		memset(c, 0, sizeof(chunk_t));
+		c->start = pos;
+		c->end = pos = q;
+		c->last = ( q == pend );
+		c->ctx = poolctx(ctx, sp.count - 1);
+		c->res = &c->ctx->out.own;
+		}
+
+	sp.next = 0;
+	pthread_mutex_init(&sp.lock, NULL);
+	pthread_cond_init(&sp.cond, NULL);
+	nthreads = ( ctx->nthreads < sp.count ) ? ctx->nthreads : sp.count;
+	tid = (pthread_t *) aralloc(&ctx->arena, nthreads * sizeof(pthread_t));
+	for ( i = 0; i < nthreads; i ++ )
+		if ( pthread_create(&tid[i], NULL, splitworker, &sp) != 0 )
+			break;
+	nthreads = i;
+	if ( nthreads == 0 )
+		splitworker(&sp);
+
+	// join them in order
+	for ( pos = p, i = 0; i < sp.count; i ++ ) {
+		c = &sp.chunks[i];
+		pthread_mutex_lock(&sp.lock);
+		while ( !c->done )
+			pthread_cond_wait(&sp.cond, &sp.lock);
+		pthread_mutex_unlock(&sp.lock);
+
+		if ( valid ) {
+			if ( c->ok && pos == c->start && mdclean(ctx) ) {
+				if ( c->res->len )
+					owrite(&ctx->out, c->res->data, c->res->len);
+				mdstate(ctx, c->ctx);
+				addstats(&ctx->stats, &c->ctx->stats);
+				pos = c->end;
+				}
+			else if ( pos < c->end ) { // again, after the previous one
+				pos = mdblocks(ctx, source, pos, c->end, pend);
+				valid = mdrender(ctx, source);
+				}
+			}
+		}
+
+	for ( i = 0; i < nthreads; i ++ )
+		pthread_join(tid[i], NULL);
+	pthread_cond_destroy(&sp.cond);
+	pthread_mutex_destroy(&sp.lock);
+	errno = err;
+	return valid;
+}
+
+/*
+*	sets the threads 'ctx' may use to convert one document;
+*	0 means one per CPU
+*/
+void md2roff_setthreads(md2roff_ctx *ctx, int n)
+{
+	if ( n <= 0 )
+		n = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	ctx->nthreads = ( n > 0 ) ? n : 1;
+}
+
+/*
+*	returns the threads of 'ctx' for one document
+*/
+int md2roff_threads(const md2roff_ctx *ctx)
+{
+	return ctx->nthreads;
+}
+
+/*
+ *	--- incremental conversion ---
+ *
+ *	the document is cut in sections, before each header that follows a
+ *	blank line, and the output of each section is kept with its text.
+ *	when the next document has a section with the same text, and the
+ *	conversion reaches it in the state that a chunk of mdparallel()
+ *	assumes, its output is copied instead of converted again; so an edit
+ *	converts only the sections it changed, and the output is the same.
+ *	sections that do not end in that state are not kept.
+ */
+struct section {
+	uint64_t	hash;		// of the text, 0 for a free slot
+	strbuf_t	text;		// the section
+	strbuf_t	out;		// and its output
+	bool		used;		// by the last document
+	};
+
+/*
+ *	returns the slot of the section with the text 'p' of 'len' bytes and
+ *	the 'hash', or the free slot where it goes.
+ */
+static section_t *findsection(md2roff_ctx *ctx, uint64_t hash, const char *p, size_t len)
+{
+	size_t		i = hash & (ctx->sectsize - 1);
+	section_t	*e;
+
+	for ( ;; i = (i + 1) & (ctx->sectsize - 1) ) {
+		e = &ctx->sect[i];
+		if ( e->hash == 0 )
+			return e;
+		if ( e->hash == hash && e->text.len == len && memcmp(e->text.data, p, len) == 0 )
+			return e;
+		}
+}
+
+/*
+ *	rebuilds the table of 'ctx' with the sections of the last document,
+ *	and room for the next one; all of them, if 'all' is true.
+ */
+static void keepsections(md2roff_ctx *ctx, bool all)
+{
+	section_t	*old = ctx->sect;
+	size_t		i, n = ctx->sectsize, size = 64;
+
+	for ( i = ctx->nsect = 0; i < n; i ++ )
+		if ( old[i].hash && (all || old[i].used) )
+			ctx->nsect ++;
+	while ( size < ctx->nsect * 4 )
+		size *= 2;
+	ctx->sect = (section_t *) xrealloc(NULL, size * sizeof(section_t));
+	memset(ctx->sect, 0, size * sizeof(section_t));
+	ctx->sectsize = size;
+	for ( i = 0; i < n; i ++ ) {
+		if ( old[i].hash && (all || old[i].used) ) {
+			*findsection(ctx, old[i].hash, old[i].text.data, old[i].text.len) = old[i];
+			continue;
+			}
+		free(old[i].text.data);
+		free(old[i].out.data);
+		}
+	free(old);
+}
+
+/*
+ *	returns the end of the section that starts at 'p'; the beginning of
+ *	the next header line after a blank line, or 'pend'.
+ */
+static const char *sectionend(const char *p, const char *pend)
+{
+	const char *q, *nl;
+
+	while ( p < pend && (p = memchr(p, '\n', pend - p)) != NULL ) {
+		p ++;
+		if ( p < pend && *p == '\n' ) {
+			q = p + 1;
+			if ( q < pend && *q == '#' )
+				return q;
+			if ( q < pend && (nl = memchr(q, '\n', pend - q)) != NULL
+					&& (isprefix(nl + 1, pend, "===") || isprefix(nl + 1, pend, "---")) )
+				return q;
+			}
+		}
+	return pend;
+}
+
+/*
+ *	hash of the settings of 'ctx' that change the output of a section:
+ *	the package, the deepest list and the callback of the images; the
+ *	sections of each are kept apart, as md2roff_convertmany() changes
+ *	the package.
+ */
+static uint64_t sectionconf(const md2roff_ctx *ctx)
+{
+	char	b[2 * sizeof(int) + sizeof(md2roff_imagefn) + sizeof(void *)];
+	int		mp = ctx->mpack;
+
+	memcpy(b, &mp, sizeof(int));
+	memcpy(b + sizeof(int), &ctx->maxdepth, sizeof(int));
+	memcpy(b + 2 * sizeof(int), &ctx->imagefn, sizeof(md2roff_imagefn));
+	memcpy(b + 2 * sizeof(int) + sizeof(md2roff_imagefn), &ctx->imagearg, sizeof(void *));
+	return hashmem(b, sizeof(b));
+}
+
+/*
+ *	converts the document 'source' as md2roff(), reusing the output of
+ *	the sections that were in the previous one.
+ *	returns false if the document is invalid.
+ */
+static bool mdincremental(md2roff_ctx *ctx, const char *docname, const char *source, size_t len)
+{
+	const char *p = source, *pend = source + len, *pos, *end;
+	md2roff_ctx *w = poolctx(ctx, 0);
+	section_t	*e;
+	uint64_t	hash, conf = sectionconf(ctx);
+	int			err = errno;
+	bool		valid = true;
+
+	p = ctx->be->preamble(ctx, docname, p, pend);
+	ctx->started = true;
+	if ( ctx->nsect * 2 >= ctx->sectsize )
+		keepsections(ctx, true);
+	for ( size_t i = 0; i < ctx->sectsize; i ++ )
+		ctx->sect[i].used = false;
+
+	for ( pos = p; valid && p < pend; p = end ) {
+		end = sectionend(p, pend);
+		if ( pos == p && mdclean(ctx) ) {
+			hash = hashmem(p, end - p) ^ ctx->defs.hash ^ conf; // a new definition changes them all
+			hash += ( hash == 0 );
+			e = findsection(ctx, hash, p, end - p);
+			if ( e->hash == 0 && convchunk(w, p, end, end == pend) ) {
+				if ( w->out.own.len )
+					owrite(&ctx->out, w->out.own.data, w->out.own.len);
+				mdstate(ctx, w);
+				addstats(&ctx->stats, &w->stats);
+				pos = end;
+				if ( mdclean(w) ) { // keep it
+					e->hash = hash;
+					e->text.len = 0;
+					sbnadd(&e->text, p, end - p);
+					e->out = w->out.own;
+					memset(&w->out.own, 0, sizeof(strbuf_t));
+					e->used = true;
+					if ( ++ ctx->nsect * 2 >= ctx->sectsize )
+						keepsections(ctx, true);
+					}
+				continue;
+				}
+			if ( e->hash ) {
+				if ( e->out.len )
+					owrite(&ctx->out, e->out.data, e->out.len);
+				e->used = true;
+				pos = end;
+				continue;
+				}
+			}
+		if ( pos < end ) {
+			pos = mdblocks(ctx, source, pos, end, pend);
+			valid = mdrender(ctx, source);
+			}
+		}
+	keepsections(ctx, false);
+	errno = err;
+	return valid;
+}
+
+/*
+*	keeps the sections of each document converted by 'ctx' for the next
+*	one, or drops them
+*/
+void md2roff_setincremental(md2roff_ctx *ctx, int on)
+{
+	ctx->incremental = on;
+	if ( !on ) {
+		for ( size_t i = 0; i < ctx->sectsize; i ++ ) {
+			free(ctx->sect[i].text.data);
+			free(ctx->sect[i].out.data);
+			}
+		free(ctx->sect);
+		ctx->sect = NULL;
+		ctx->nsect = ctx->sectsize = 0;
+		}
+}
+
+/*
+ *	converts 'src' to 'sink' with the context 'ctx'; see md2roff.h
+ */
+int md2roff_convert(md2roff_ctx *ctx, const char *docname,
+		const char *src, size_t len, const md2roff_sink *sink)
+{
+	bool valid;
+
+	mdsink(ctx, sink);
+	mdbegin(ctx);
+	arreset(&ctx->arena);
+	mddefs(ctx, src, src + len, false);
+	if ( ctx->incremental )
+		valid = mdincremental(ctx, docname, src, len);
+	else if ( ctx->nthreads > 1 && len >= 2 * SPLIT_MIN )
+		valid = mdparallel(ctx, docname, src, len);
+	else
+		valid = md2roff(ctx, docname, src, len);
+	if ( valid )
+		mdfinish(ctx);
+	oend(&ctx->out);
+	ctx->stats.docs ++;
+	ctx->stats.bytes_in += len;
+	ctx->stats.bytes_out += obytes(&ctx->out);
+	ctx->stats.bytes_saved += ctx->out.saved;
+	return mdstatus(ctx);
+}
+
+/*
+ *	converts 'src' once for each of the 'n' packages 'mp', to 'sinks';
+ *	see md2roff.h. the packages are taken in groups that find the same
+ *	blocks, the ones whose text starts at the same place, and that write
+ *	#### headers the same way if there are any; the index of the blocks
+ *	is made once for each group.
+ */
+int md2roff_convertmany(md2roff_ctx *ctx, const char *docname, const char *src,
+		size_t len, const macropackage_t *mp, const md2roff_sink *sinks, int n)
+{
+	macropackage_t	save = ctx->mpack;
+	const char	*pend = src + len, *start, *title = src;
+	bool		parallel = ctx->nthreads > 1 && len >= 2 * SPLIT_MIN;
+	bool		h4 = false, s4, bline = true, bcode = false, *done;
+	int			rv = 0, i, j;
+
+	if ( hastitle(src, pend) ) {
+		title = memchr(src, '\n', len);
+		title = ( title ) ? title + 1 : pend;
+		}
+	done = (bool *) xrealloc(NULL, n * sizeof(bool));
+	memset(done, 0, n * sizeof(bool));
+	mdnodefs(ctx);
+	arreset(&ctx->arena);
+	mddefs(ctx, src, pend, false);
+	for ( i = 0; i < n; i ++ ) {
+		if ( done[i] )
+			continue;
+		start = ( backends[mp[i]].title ) ? title : src;
+		s4 = backends[mp[i]].s4_close.n != 0;
+		if ( !parallel ) {
+			md2roff_setpackage(ctx, mp[i]);
+			mdstart(ctx); // the state the index starts from
+			mdblocks(ctx, src, start, pend, pend);
+			bline = ctx->bline;
+			bcode = ctx->bcode;
+			for ( h4 = false, j = 0; (size_t) j < ctx->nblk && !h4; j ++ )
+				h4 = ctx->blk[j].type == blk_header && ctx->blk[j].level == 4;
+			}
+		for ( j = i; j < n; j ++ ) {
+			if ( done[j] || (( backends[mp[j]].title ) ? title : src) != start
+					|| (h4 && (backends[mp[j]].s4_close.n != 0) != s4) )
+				continue;
+			if ( parallel && j > i )
+				break;
+			done[j] = true;
+			md2roff_setpackage(ctx, mp[j]);
+			mdsink(ctx, &sinks[j]);
+			mdstart(ctx);
+			oputs(&ctx->out, ".\\\" x-roff document");
+			if ( parallel ) {
+				if ( mdparallel(ctx, docname, src, len) )
+					mdfinish(ctx);
+				}
+			else {
+				ctx->be->preamble(ctx, docname, src, pend);
+				ctx->started = true;
+				ctx->bline = bline; // the state at the end of the index
+				ctx->bcode = bcode;
+				if ( mdrender(ctx, src) )
+					mdfinish(ctx);
+				}
+			oend(&ctx->out);
+			ctx->stats.docs ++;
+			ctx->stats.bytes_in += len;
+			ctx->stats.bytes_out += obytes(&ctx->out);
+			ctx->stats.bytes_saved += ctx->out.saved;
+			if ( mdstatus(ctx) != 0 )
+				rv = -1;
+			}
+		}
+	free(done);
+	md2roff_setpackage(ctx, save);
+	return rv;
+}
+
+/*
+ *	--- streaming ---
+ *
+ *	the input is collected in 'ctx->in' and converted up to the end of
+ *	its last complete block, the blank line after it (blank lines inside
+ *	code-blocks do not count). what follows stays for the next call.
+ */
+
+/*
+ *	returns the length of the complete blocks in 'ctx->in', or 0;
+ *	each byte is searched once, 'scanned' is always at a beginning of line.
+ */
+static size_t lastcut(md2roff_ctx *ctx)
+{
+	const char *s = ctx->in.data, *p = s + ctx->scanned, *end = s + ctx->in.len, *nl;
+	size_t	cut = 0;
+
+	while ( (nl = memchr(p, '\n', end - p)) != NULL ) {
+		if ( isprefix(p, nl, "```") )
+			ctx->infence = !ctx->infence;
+		else if ( nl == p && !ctx->infence )
+			cut = nl + 1 - s;
+		p = nl + 1;
+		}
+	ctx->scanned = p - s;
+	return cut;
+}
+
+/*
+ *	starts the streamed document 'docname'; see md2roff.h
+ */
+int md2roff_begin(md2roff_ctx *ctx, const char *docname, const md2roff_sink *sink)
+{
+	mdsink(ctx, sink);
+	mdbegin(ctx);
+	arreset(&ctx->arena);
+	ctx->name.len = 0;
+	sbnadd(&ctx->name, docname, strlen(docname));
+	sbcstr(&ctx->name);
+	ctx->in.len = 0;
+	ctx->scanned = 0;
+	ctx->infence = false;
+	return mdstatus(ctx);
+}
+
+/*
+ *	the next 'len' bytes of the streamed document; see md2roff.h
+ */
+int md2roff_feed(md2roff_ctx *ctx, const char *src, size_t len)
+{
+	strbuf_t *b = &ctx->in;
+	size_t	cut;
+
+	if ( ctx->failed )
+		return -1;
+	ctx->stats.bytes_in += len;
+	sbnadd(b, src, len);
+	if ( (cut = lastcut(ctx)) != 0 ) {
+		mddefs(ctx, b->data, b->data + cut, true);
+		md2roff(ctx, ctx->name.data, b->data, cut);
+		memmove(b->data, b->data + cut, b->len - cut);
+		b->len -= cut;
+		ctx->scanned -= cut;
+		oflush(&ctx->out);
+		}
+	return mdstatus(ctx);
+}
+
+/*
+ *	finishes the streamed document; see md2roff.h
+ */
+int md2roff_end(md2roff_ctx *ctx)
+{
+	if ( !ctx->failed )
+		mddefs(ctx, ctx->in.data, ctx->in.data + ctx->in.len, true);
+	if ( !ctx->failed && md2roff(ctx, ctx->name.data, ctx->in.data, ctx->in.len) )
+		mdfinish(ctx);
+	ctx->in.len = 0;
+	ctx->scanned = 0;
+	oend(&ctx->out);
+	ctx->stats.docs ++;
+	ctx->stats.bytes_out += obytes(&ctx->out);
+	ctx->stats.bytes_saved += ctx->out.saved;
+	return mdstatus(ctx);
+}
+
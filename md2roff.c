@@ -17,18 +17,43 @@
  *	See LICENSE for details.
  */
 
+
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <ctype.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/uio.h>
+#include <spawn.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
-// options
-typedef enum { mp_mm, mp_man, mp_mdoc, mp_mom } macropackage_t;
-macropackage_t	mpack = mp_man;
+#include "md2roff.h"
+
+// the short names of the packages of md2roff.h
+typedef md2roff_package_t macropackage_t;
+#define	mp_mm		MD2ROFF_MM
+#define	mp_man		MD2ROFF_MAN
+#define	mp_mdoc		MD2ROFF_MDOC
+#define	mp_mom		MD2ROFF_MOM
 
 /*
  * if 'when' is true, print error message and quit
@@ -47,814 +72,1676 @@ void panicif(int when, const char *fmt, ...)
 	va_end(ap);
 }
 
+#define	LOAD_CHUNK	(64 * 1024)
+
 /*
- * clone string
+ * Reads everything from the descriptor `fd` into memory and returns a
+ * pointer to it; the length is stored in `lenp` (the data may contain
+ * '\0' bytes, a terminator is added after them). The pointer must freed
+ * by the user.
+ *
+ * The buffer is presized from fstat() for regular files, or from
+ * FIONREAD for pipes, and doubles each time it fills up.
  */
-char *strdup(const char *s)
+char *loadfd(int fd, size_t *lenp)
 {
-	char *d = (char *) malloc(strlen(s) + 1); 
-    if ( d )
-		strcpy(d, s);
-    return d;
+	size_t	len = 0, alloc = LOAD_CHUNK;
+	ssize_t	n;
+	struct stat st;
+	char	*buf;
+
+	if ( fstat(fd, &st) == 0 ) {
+		if ( S_ISREG(st.st_mode) ) {
+			off_t pos = lseek(fd, 0, SEEK_CUR);
+			// one spare byte for the terminator and one to see the EOF
+			if ( pos >= 0 && pos < st.st_size )
+				alloc = (size_t) (st.st_size - pos) + 2;
+			}
+#ifdef FIONREAD
+		else if ( S_ISFIFO(st.st_mode) ) {
+			int avail = 0;
+			if ( ioctl(fd, FIONREAD, &avail) == 0 && avail > 0 )
+				alloc = (size_t) avail + LOAD_CHUNK;
+			}
+#endif
+		}
+
+	buf = (char *) malloc(alloc);
+	panicif(buf == NULL, "out of memory");
+	for ( ;; ) {
+		if ( alloc - len < 2 ) {
+			panicif(alloc * 2 < alloc, "input too large");
+			alloc *= 2;
+			buf = (char *) realloc(buf, alloc);
+			panicif(buf == NULL, "out of memory");
+			}
+		n = read(fd, buf + len, alloc - len - 1);
+		if ( n == 0 )
+			break;
+		if ( n < 0 ) {
+			panicif(errno != EINTR, "read failed");
+			continue;
+			}
+		len += n;
+		}
+	buf[len] = '\0';
+	*lenp = len;
+	return buf;
 }
 
 /*
- *	squeeze (& strdup)
+ * a loaded input document
  */
-char *sqzdup(const char *source)
-{
-	char *rp, *p, *d;
-	int lc = 0;
+typedef struct {
+	char	*data;		// contents, not terminated if mapped
+	size_t	len;
+	bool	mapped;		// data is mmap()ed, otherwise malloc()ed
+	} input_t;
 
-	rp = malloc(strlen(source) + 1);
-	p = (char *) source;
-	d = rp;
+/*
+ * Loads the `filename` file (or stdin if it is NULL) into `in`.
+ *
+ * Regular files are mapped read-only with sequential read-ahead, so the
+ * input costs no copy and no extra memory; anything that cannot be
+ * mapped (pipes, terminals, special files) is read with loadfd().
+ * The data must released with unloadfile().
+ */
+void loadfile(input_t *in, const char *filename)
+{
+	int		fd = STDIN_FILENO;
+	struct stat st;
 
-	while ( isspace(*p) ) p ++;
+	if ( filename )
+		panicif((fd = open(filename, O_RDONLY)) == -1, "Unable to open '%s'", filename);
 
-	while ( *p ) {
-		if ( isspace(*p) ) {
-			if ( !lc ) {
-				lc = 1;
-				if ( p > source ) {
-					if ( isalnum(*(p - 1)) )
-						*d ++ = ' ';
-					else {
-						char *nc = p;
-						while ( isspace(*nc) )
-							nc ++;
-						if ( isalnum(*nc) )
-							*d ++ = ' ';
-						}
-					}
-				}
+	in->mapped = false;
+	if ( fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0
+			&& (uintmax_t) st.st_size <= SIZE_MAX && lseek(fd, 0, SEEK_CUR) == 0 ) {
+		void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if ( map != MAP_FAILED ) {
+			posix_madvise(map, st.st_size, POSIX_MADV_SEQUENTIAL);
+			in->data = (char *) map;
+			in->len = st.st_size;
+			in->mapped = true;
 			}
-		else {
-			lc = 0;
-			*d ++ = *p;
+		}
+	if ( !in->mapped )
+		in->data = loadfd(fd, &in->len);
+
+	if ( filename )
+		close(fd);
+}
+
+/*
+ * releases the data of `in`
+ */
+void unloadfile(input_t *in)
+{
+	if ( in->mapped )
+		munmap(in->data, in->len);
+	else
+		free(in->data);
+	in->data = NULL;
+	in->len = 0;
+}
+
+/*
+ * --- main() ---
+ */
+static char *usage ="\
+usage: md2roff [options] [file1 .. [fileN]]\n\
+\t-n, --man\n\t\tuse man package (default)\n\
+\t-d, --mdoc\n\t\tuse mdoc package (BSD man-pages)\n\
+\t-m, --mm\n\t\tuse mm package\n\
+\t-o, --mom\n\t\tuse mom package\n\
+\t-j, --jobs N\n\t\tconvert N files in parallel (0: one per CPU)\n\
+\t-T, --threads N\n\t\tconvert each large file with N threads (0: one per CPU)\n\
+\t-O, --outdir DIR\n\t\twrite each FILE to DIR/FILE.1 instead of stdout\n\
+\t-e, --emit PKG:PATH,...\n\t\twrite each FILE to PATH for each package PKG (man, mdoc,\n\t\tmm, mom), parsed once; % in PATH is the name of FILE\n\
+\t-w, --watch\n\t\tconvert the files again each time they change, to\n\t\tDIR/FILE.1, or FILE.1 next to them without -O\n\
+\t-S, --serve SOCKET\n\t\tconvert the requests of the clients of the Unix socket\n\t\tSOCKET, or of stdin if it is -, until it is killed\n\
+\t-s, --stats\n\t\tprint the counters of each file to stderr, as a JSON line\n\
+\t-C, --compact\n\t\tdrop the requests that do not change the document\n\
+\t-c, --cache-dir DIR\n\t\treuse the outputs of the same inputs stored in DIR\n\
+\t-i, --images DIR\n\t\tconvert the images for the package to DIR, with\n\t\t$MD2ROFF_CONVERT (default: convert)\n\
+\t-h, --help\n\t\tprint this screen\n\
+\t-v, --version\n\t\tprint version information\n\
+";
+
+static char *version ="\
+md2roff, version " MD2ROFF_VERSION "\n\
+Copyright (C) 2017 Free Software Foundation, Inc.\n\
+License GPLv3+: GNU GPL version 3 or later <http://gnu.org/licenses/gpl.html>.\n\
+This is free software: you are free to change and redistribute it.\n\
+There is NO WARRANTY, to the extent permitted by law.\n\
+";
+
+/*
+ * --- output cache ---
+ *
+ * the output is stored in 'cachedir' with the name of the hash of all
+ * that makes it: the converter version and output revision, the macro
+ * package, the document name and header date, --compact, and the input.
+ * when the same is converted again the stored output is copied.
+ */
+static const char	*cachedir;		// --cache-dir, NULL for none
+static char			docdate[32];	// date of the default header, empty for today
+static bool			compact;		// --compact
+
+/*
+ * sets 'docdate' from SOURCE_DATE_EPOCH, in UTC, as the reproducible
+ * builds do; if it is not set and 'today' is true, to the local date
+ * of now, so the whole run uses one date.
+ */
+void setdocdate(bool today)
+{
+	const char *sde = getenv("SOURCE_DATE_EPOCH");
+	char	*end;
+	time_t	tt;
+	struct tm t;
+
+	if ( docdate[0] )
+		return;
+	if ( sde && *sde ) {
+		errno = 0;
+		tt = (time_t) strtoll(sde, &end, 10);
+		if ( errno || *end || !gmtime_r(&tt, &t) ) {
+			fprintf(stderr, "invalid SOURCE_DATE_EPOCH: [%s]\n", sde);
+			return;
 			}
-		p ++;
 		}
+	else if ( today ) {
+		tt = time(0);
+		localtime_r(&tt, &t);
+		}
+	else
+		return;
+	strftime(docdate, sizeof(docdate), "%Y-%m-%d", &t);
+}
 
-	*d = '\0';
-	if ( d > rp ) {
-		if ( isspace(*(d - 1)) ) 
-			*(d - 1) = '\0';
+/*
+ * 128-bit hash, two 64-bit lanes; not cryptographic, but wide enough
+ * that different inputs do not meet by chance.
+ */
+typedef struct { uint64_t a, b; } hash_t;
+
+#define	HK1	0x9E3779B185EBCA87ULL
+#define	HK2	0xC2B2AE3D27D4EB4FULL
+#define	HK3	0x165667B19E3779F9ULL
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+// murmur3 finalizer
+static inline uint64_t fmix64(uint64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xFF51AFD7ED558CCDULL;
+	x ^= x >> 33;
+	x *= 0xC4CEB9FE1A85EC53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+/*
+ * adds the 'len' bytes of 'data' to 'h'; the length is added too, so
+ * a sequence of calls is one unambiguous key
+ */
+void hashadd(hash_t *h, const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *) data, *end = p + len;
+	unsigned char tail[16];
+	uint64_t w1, w2;
+
+	for ( ;; ) {
+		if ( end - p < 16 ) { // the last block, zero padded
+			memset(tail, 0, sizeof(tail));
+			memcpy(tail, p, end - p);
+			p = tail;
+			}
+		memcpy(&w1, p, 8);
+		memcpy(&w2, p + 8, 8);
+		h->a = rotl64(h->a ^ (w1 * HK1), 31) * HK2;
+		h->b = rotl64(h->b ^ (w2 * HK2), 27) * HK1;
+		if ( p == tail )
+			break;
+		p += 16;
 		}
-	
-	return rp;
+	h->a ^= (uint64_t) len * HK3;
+	h->b += (uint64_t) len;
 }
 
 /*
- * Loads the `filename` file into memory and return a pointer to its contents.
- * The pointer must freed by the user.
+ * stores in 'path' the cache file of the conversion of 'in'
  */
-char *loadfile(const char *filename)
-{
-	int len = -1, c, alloc;
-	FILE *fp;
-	char *buf;
-
-	if ( filename == NULL ) {
-		len = 0;
-		alloc = 1024;
-		buf = (char *) malloc(alloc);
-		while ( (c = fgetc(stdin)) != EOF ) {
-			buf[len] = c;
-			len ++;
-			if ( len >= alloc ) {
-				alloc += 1024;
-				buf = (char *) realloc(buf, alloc);
-				}
+void cachepath(char *path, size_t size, const md2roff_ctx *ctx, const char *name, const input_t *in)
+{
+	hash_t	h = { HK1, HK2 };
+	int		mp = md2roff_package(ctx), rev = MD2ROFF_REVISION;
+	uint64_t a, b;
+
+	hashadd(&h, MD2ROFF_VERSION, strlen(MD2ROFF_VERSION));
+	hashadd(&h, &rev, sizeof(rev));
+	hashadd(&h, &mp, sizeof(mp));
+	hashadd(&h, name, strlen(name));
+	hashadd(&h, docdate, strlen(docdate));
+	if ( compact ) // the keys without it stay the same
+		hashadd(&h, "compact", 7);
+	hashadd(&h, in->data, in->len);
+	a = fmix64(h.a + h.b);
+	b = fmix64(h.b ^ a);
+	snprintf(path, size, "%s/%016llx%016llx.roff", cachedir,
+		(unsigned long long) a, (unsigned long long) b);
+}
+
+/*
+ * writes the 'len' bytes of 'data' to 'sink'; returns false on failure
+ */
+bool sinkwrite(const md2roff_sink *sink, const char *data, size_t len)
+{
+	ssize_t	n;
+
+	if ( len == 0 )
+		return true;
+	if ( sink->fd == -1 ) {
+		md2roff_buf *b = sink->mem;
+		if ( b->len + len > b->size ) {
+			size_t size = ( b->size ) ? b->size : 4096;
+			while ( size < b->len + len )
+				size *= 2;
+			b->data = (char *) realloc(b->data, size);
+			panicif(b->data == NULL, "out of memory");
+			b->size = size;
 			}
+		memcpy(b->data + b->len, data, len);
+		b->len += len;
+		return true;
 		}
-	else {
-		panicif((fp = fopen(filename, "r")) == NULL, "Unable to open '%s'", filename);
-		panicif((fseek(fp, 0L, SEEK_END) == -1), "fseek failed");
-		panicif((len = ftell(fp)) == -1, "ftell failed");
-		panicif((fseek(fp, 0L, SEEK_SET) == -1), "fseek failed");
-		buf = (char *) malloc(len+1);
-		panicif((fread(buf, len, 1, fp) == -1), "fread failed");
-		buf[len] = '\0';
-		fclose(fp);
+	while ( len ) {
+		if ( (n = write(sink->fd, data, len)) < 0 ) {
+			if ( errno == EINTR )
+				continue;
+			return false;
+			}
+		data += n;
+		len -= n;
 		}
-
-	return buf;
+	return true;
 }
 
 /*
- * adds the string 'str' to buffer 'buf' and returns
- * a pointer to new position in buf.
+ * writes the 'len' bytes of 'data' to the file 'path', with the
+ * permissions 'mode'; to a new file that is renamed to 'path', so
+ * readers see all of it or nothing. returns false on failure.
  */
-char *stradd(char *buf, const char *str)
+bool storefile(const char *path, const char *data, size_t len, mode_t mode)
 {
-	const char *p = str;
-	char *d = buf;
+	char	tmp[4096 + 16];
+	int		fd;
+	bool	stored;
 
-	while ( *p )
-		*d ++ = *p ++;
-	return d;
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	if ( (fd = mkstemp(tmp)) == -1 )
+		return false;
+	md2roff_sink fsink = { fd, NULL };
+	stored = fchmod(fd, mode) == 0 && sinkwrite(&fsink, data, len);
+	if ( close(fd) == -1 || !stored || rename(tmp, path) == -1 ) {
+		unlink(tmp);
+		return false;
+		}
+	return true;
 }
 
 /*
- * prints the whole line of 'src' and returns pointer
- * to the next character (the first of the next line).
+ * --- images ---
+ *
+ * with --images DIR, the images of the documents are converted to the
+ * format the package loads (see md2roff.h) by an external converter, the
+ * shell command MD2ROFF_CONVERT or ImageMagick's convert, that is run
+ * with the input and the output files as its arguments. The output is
+ * DIR/HASH.eps or DIR/HASH.pdf, named by the hash of the image and the
+ * format, so an image that did not change is not converted again, and an
+ * image of many documents once. Up to 'imgq.max' converters run at the
+ * same time, while the documents are converted; imgwait() waits for them.
  */
-const char *println(const char *src)
+static const char	*imgdir;		// --images, NULL for none
+
+extern char	**environ;
+
+typedef struct {
+	pid_t	pid;
+	char	*tmp, *dst;		// the converter writes 'tmp', that is renamed to 'dst'
+	} imgjob_t;
+
+static struct {
+	imgjob_t	*run;		// running converters, 'max' entries
+	int			nrun, max;
+	char		**seen;		// outputs converted or running in this run
+	int			nseen, seenalloc;
+	bool		failed;		// a conversion failed since the last imgwait()
+	pthread_mutex_t	lock;
+	} imgq = { .max = 1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ * waits for one of the running converters and moves its output in place;
+ * with 'imgq.lock' held.
+ */
+static void imgreap(void)
 {
-	const char *p = src;
+	int		st, i;
+	pid_t	pid;
 
-	while ( *p ) {
-		putchar(*p);
-		p ++;
-		if ( *(p-1) == '\n' )
-			break;
+	while ( (pid = waitpid(-1, &st, 0)) == -1 )
+		panicif(errno != EINTR, "waitpid failed");
+	for ( i = 0; i < imgq.nrun && imgq.run[i].pid != pid; i ++ )
+		;
+	if ( i == imgq.nrun ) // not a converter
+		return;
+	imgjob_t *j = &imgq.run[i];
+	if ( !WIFEXITED(st) || WEXITSTATUS(st) != 0 || rename(j->tmp, j->dst) == -1 ) {
+		fprintf(stderr, "Unable to convert the image '%s'\n", j->dst);
+		unlink(j->tmp);
+		imgq.failed = true;
 		}
-	return p;
+	free(j->tmp);
+	free(j->dst);
+	imgq.run[i] = imgq.run[-- imgq.nrun];
 }
 
 /*
-*	types of elements
-*/
-enum { none,
-		par_end, ln_brk,
-		cblock_end, cblock_open,
-		li_open, li_end,
-		ol_open, ul_open, lst_close,
-		man_ref, ol, ul,
-		bq_open, bq_close,
-		box_open, box_close,
-		url_mark,
-		new_sh, new_ss, new_s4 };
+ * starts the conversion of the image 'src' to 'dst', unless it is
+ * converted already in this run
+ */
+static void imgconvert(const char *src, const char *dst)
+{
+	const char	*cmd = getenv("MD2ROFF_CONVERT");
+	const char	*base = strrchr(dst, '/');
+	char		*argv[7];
+	imgjob_t	*j;
+	int			i, rv;
+
+	pthread_mutex_lock(&imgq.lock);
+	for ( i = 0; i < imgq.nseen && strcmp(imgq.seen[i], dst) != 0; i ++ )
+		;
+	if ( i < imgq.nseen ) {
+		pthread_mutex_unlock(&imgq.lock);
+		return;
+		}
+	if ( imgq.nseen == imgq.seenalloc ) {
+		imgq.seenalloc = ( imgq.seenalloc ) ? imgq.seenalloc * 2 : 64;
+		imgq.seen = (char **) realloc(imgq.seen, imgq.seenalloc * sizeof(char *));
+		panicif(imgq.seen == NULL, "out of memory");
+		}
+	panicif((imgq.seen[imgq.nseen ++] = strdup(dst)) == NULL, "out of memory");
+	if ( imgq.run == NULL ) {
+		imgq.run = (imgjob_t *) malloc(imgq.max * sizeof(imgjob_t));
+		panicif(imgq.run == NULL, "out of memory");
+		}
+	while ( imgq.nrun == imgq.max )
+		imgreap();
+
+	j = &imgq.run[imgq.nrun];
+	base = ( base ) ? base + 1 : dst;
+	j->tmp = (char *) malloc(strlen(dst) + 32);
+	panicif((j->dst = strdup(dst)) == NULL || j->tmp == NULL, "out of memory");
+	sprintf(j->tmp, "%.*s.%ld-%s", (int) (base - dst), dst, (long) getpid(), base);
+
+	// the files are arguments of the shell, they are not parsed by it;
+	// what the converter prints goes to stderr, stdout may be the output
+	argv[0] = "sh";
+	argv[1] = "-c";
+	argv[2] = ( cmd && *cmd ) ? "eval \"$MD2ROFF_CONVERT\" '\"$1\" \"$2\" >&2'" : "convert \"$1\" \"$2\" >&2";
+	argv[3] = "sh";
+	argv[4] = (char *) src;
+	argv[5] = j->tmp;
+	argv[6] = NULL;
+	if ( (rv = posix_spawnp(&j->pid, "sh", NULL, NULL, argv, environ)) != 0 ) {
+		fprintf(stderr, "Unable to run the image converter [%s]\n", strerror(rv));
+		imgq.failed = true;
+		free(j->tmp);
+		free(j->dst);
+		}
+	else
+		imgq.nrun ++;
+	pthread_mutex_unlock(&imgq.lock);
+}
 
 /*
-*	list (enumeration/itemize) stack
-*/
-#define	MAX_LIST_SIZE	32
-int		stk_list[MAX_LIST_SIZE];	// type of list
-int		stk_count[MAX_LIST_SIZE];	// counter of item
-int		stk_list_p = 0;				// top pointer, always points to first free
+ * waits for the running converters; returns false if any conversion
+ * failed since the last call
+ */
+bool imgwait(void)
+{
+	bool	ok;
+
+	pthread_mutex_lock(&imgq.lock);
+	while ( imgq.nrun )
+		imgreap();
+	ok = !imgq.failed;
+	imgq.failed = false;
+	pthread_mutex_unlock(&imgq.lock);
+	return ok;
+}
+
+static inline unsigned be16(const unsigned char *p) { return (p[0] << 8) | p[1]; }
+static inline unsigned long be32(const unsigned char *p) { return ((unsigned long) be16(p) << 16) | be16(p + 2); }
 
 /*
-*	write the roff code of 'type'
-*/
-void roff(int type, ...)
+ * sets 'w', 'h' to the size in points of the PNG, JPEG, GIF, EPS or PDF
+ * image 'p'; pixels are 1/96 inch, and wide images are made 6 inches.
+ * they are left 0 if the format is not known.
+ */
+void imgsize(const unsigned char *p, size_t len, int *w, int *h)
 {
-	va_list	ap;
-	char	*title, *link;
-
-	va_start(ap, type);
-	switch ( type ) {
-
-	// new paragraph
-	case par_end:
-		switch ( mpack ) {
-		case mp_mdoc:	puts(".Pp"); break;
-		default:		puts(".PP");
-			}
-		break;
-
-	// line break
-	case ln_brk:
-		switch ( mpack ) {
-		case mp_mom:	puts(".BR"); break;	// or .br or .EL or .LINEBREAK ????
-		default:		puts(".br");
-			}
-		break;
-
-	// link
-	case url_mark:
-		title = va_arg(ap, char *);
-		link = va_arg(ap, char *);
-		switch ( mpack ) {
-		case mp_man:
-			if ( strchr(link, '@') )
-				printf(".MT %s\n%s\n.ME\n", link, title);
-			else
-				printf(".UR %s\n%s\n.UE\n", link, title);
-			break;
-		case mp_mdoc:
-			if ( strchr(link, '@') )
-				printf(".An %s Aq Mt %s\n", title, link);
-			else
-				printf(".Lk %s \"%s\"\n", link, title);
-			break;
-		case mp_mm: // there is no such thing...
-			printf("%s <%s>\n", title, link);
-			break;
-		case mp_mom:
-			printf("%s \\*[UL]%s\\*[ULX]\n", title, link);
-			}
-		break;
-		
-	// cartouche top
-	case box_open:
-		switch ( mpack ) {
-		case mp_mom: puts(".DRH"); break;
-		case mp_man: puts(".B"); break;
-		default: puts(".FT B");
-			}
-		break;
-
-	// cartouche bottom
-	case box_close:
-		switch ( mpack ) {
-		case mp_mom: puts(".DRH"); break;
-		default: puts(".FT P"); 
-			}
-		break;
-
-	// code block - begin
-	case cblock_open:
-		switch ( mpack ) {
-		case mp_mom:  printf(".CODE\n"); break;
-		case mp_mdoc: printf(".Bd -literal -offset indent\n"); break;
-		default: printf(".RS 4\n.EX\n");
-			}
-		break;
-
-	// code block - end
-	case cblock_end:
-		switch ( mpack ) {
-		case mp_mom:  printf(".CODE OFF\n"); break;
-		case mp_mdoc: printf(".Ed\n"); break;
-		default: printf("\n.EE\n.RE\n");
-			}
-		break;
-
-	// ordered list (1..2..3..)
-	case ol_open:
-		stk_list[stk_list_p] = ol;
-		stk_count[stk_list_p] = 1;
-		stk_list_p ++;
-		switch ( mpack ) {
-		case mp_mom:
-			switch ( stk_list_p ) {
-			case 1: puts(".LIST DIGIT"); break;
-			case 2: puts(".LIST ALPHA"); break;
-			case 3: puts(".LIST DIGIT"); break;
-			case 4:	puts(".LIST alpha"); break;
-			default:
-				puts(".LIST DIGIT");
-				};
-			break;
-		case mp_mdoc: puts(".Bl -enum -offset indent"); break;
-		case mp_mm: puts(".AL");
-			}
-		break;
-
-	// unordered list (bullets)
-	case ul_open:
-		stk_list[stk_list_p] = ul;
-		stk_count[stk_list_p] = 1;
-		stk_list_p ++;
-		switch ( mpack ) {
-		case mp_mom:
-			printf(".LIST %s", ((stk_list_p % 2) ? "BULLET" : "DASH"));
-			break;
-		case mp_mdoc:
-			printf(".Bl -%s -offset indent", ((stk_list_p % 2) ? "bullet" : "dash"));
-			break;
-		case mp_mm:	puts(".BL");
-			}
-		break;
-
-	// close list
-	case lst_close:
-		switch ( mpack ) {
-		case mp_mom:  puts(".LIST OFF"); break;
-		case mp_mdoc: puts(".El");
-			}
-		break;
-
-	// list item - begin
-	case li_open:
-		switch ( mpack ) {
-		case mp_mom:  puts(".ITEM"); break;
-		case mp_mdoc: puts(".It"); break;
-		case mp_man:
-			if ( stk_list_p ) {
-				if ( stk_list[stk_list_p-1] == ul )
-					puts(".IP \\(bu 4");
-				else {
-					printf(".IP %d. 4\n", stk_count[stk_list_p-1]);
-					stk_count[stk_list_p-1] ++;
-					}
+	double	pw = 0, ph = 0, x0, y0, x1, y1;
+	const char	*box;
+	size_t	i;
+
+	if ( len >= 24 && memcmp(p, "\x89PNG\r\n\x1a\n", 8) == 0 ) {
+		pw = be32(p + 16) * 0.75;
+		ph = be32(p + 20) * 0.75;
+		}
+	else if ( len >= 10 && memcmp(p, "GIF8", 4) == 0 ) {
+		pw = (p[6] | (p[7] << 8)) * 0.75;
+		ph = (p[8] | (p[9] << 8)) * 0.75;
+		}
+	else if ( len >= 4 && p[0] == 0xFF && p[1] == 0xD8 ) { // JPEG, find the frame header
+		for ( i = 2; i + 9 < len; ) {
+			if ( p[i] != 0xFF || p[i+1] == 0xFF ) {
+				i ++;
+				continue;
 				}
-			break;
-		default: puts(".LI");
-			}
-		break;
-		
-	// list item - end
-	case li_end:
-		if ( mpack == mp_mm ) puts(".LE");
-		break;
-
-	// new big header/section
-	case new_sh:
-		switch ( mpack ) {
-		case mp_mom:  printf(".HEADING 1 \""); break;
-		case mp_mdoc: printf(".Sh "); break;
-		default: printf(".SH ");
-			}
-		break;
-
-	// new medium header/secrtion
-	case new_ss:
-		switch ( mpack ) {
-		case mp_mom:  printf(".HEADING 2 \""); break;
-		case mp_mdoc: printf(".Ss "); break;
-		default: printf(".SS ");
-			}
-		break;
-
-	// new small header/secrtion
-	case new_s4:
-		switch ( mpack ) {
-		case mp_mom:  printf(".HEADING 3 \""); break;
-		case mp_mdoc: printf(".Ss "); break;
-		default: printf(".SS ");
-			}
-		break;
-
-	// reference to man page
-	case man_ref:
-		link = va_arg(ap, char *);
-		switch ( mpack ) {
-		case mp_mdoc: printf(".Xr %s\n", link); break;
-		case mp_man: {
-			char *tmp = strdup(link);
-			char *p = strchr(tmp, ' ');
-			if ( p ) {
-				*p = '\0';
-				printf("\\fB%s\\fP(%s)\n", tmp, p+1);
+			if ( p[i+1] >= 0xC0 && p[i+1] <= 0xCF && p[i+1] != 0xC4 && p[i+1] != 0xC8 && p[i+1] != 0xCC ) {
+				ph = be16(p + i + 5) * 0.75;
+				pw = be16(p + i + 7) * 0.75;
+				break;
 				}
+			if ( p[i+1] == 0x01 || (p[i+1] >= 0xD0 && p[i+1] <= 0xD9) )
+				i += 2;
 			else
-				printf("\\fB%s\\fP\n", link);
-			free(tmp);
+				i += 2 + be16(p + i + 2);
 			}
-			break;
-		default: printf("%s\n", link);
+		}
+	else if ( len > 4 && (memcmp(p, "%!PS", 4) == 0 || memcmp(p, "%PDF", 4) == 0) ) {
+		// the first %%BoundingBox: or /MediaBox [, in the data that is terminated
+		const char *key = ( p[1] == '!' ) ? "%%BoundingBox:" : "/MediaBox";
+		for ( box = (const char *) p; (box = strstr(box, key)) != NULL; box ++ ) {
+			box += strlen(key);
+			while ( *box == ' ' || *box == '[' )
+				box ++;
+			if ( sscanf(box, "%lf %lf %lf %lf", &x0, &y0, &x1, &y1) == 4 ) {
+				pw = x1 - x0;
+				ph = y1 - y0;
+				break;
+				}
 			}
-		break;
 		}
-	
-	va_end(ap);
+	if ( pw > 432 ) {
+		ph = ph * 432 / pw;
+		pw = 432;
+		}
+	if ( pw >= 1 && ph >= 1 ) {
+		*w = (int) (pw + 0.5);
+		*h = (int) (ph + 0.5);
+		}
 }
 
 /*
- *  write buffer and reset
+ * the md2roff_imagefn of --images; 'arg' is the name of the document,
+ * the images are relative to its directory.
  */
-char *flushln(char *d, char *bf)
+int image(void *arg, md2roff_image *img)
 {
-	if ( d > bf ) {
-		*d = '\0';
-		d = bf;
-		while ( isspace(*d) )
-			d ++;
-		if ( *d ) {
-			char *z = sqzdup(d);
-			puts(z);
-			free(z);
-			}
+	static const char *exts[] = { [MD2ROFF_EPS] = ".eps", [MD2ROFF_PDF] = ".pdf" };
+	const char	*doc = (const char *) arg, *base = strrchr(doc, '/'), *ext;
+	char		src[4096];
+	hash_t		h = { HK1, HK2 };
+	uint64_t	a, b;
+	char		*data;
+	size_t		len;
+	int			fd, n;
+
+	if ( img->srclen == 0 || memchr(img->src, ':', img->srclen) ) // an URL
+		return -1;
+	if ( img->src[0] == '/' || base == NULL )
+		base = doc;
+	else
+		base ++;
+	n = snprintf(src, sizeof(src), "%.*s%.*s", (int) (base - doc), doc, (int) img->srclen, img->src);
+	if ( n >= (int) sizeof(src) || (fd = open(src, O_RDONLY)) == -1 ) {
+		fprintf(stderr, "%s: Unable to open the image '%s'\n", doc, src);
+		return -1;
+		}
+	data = loadfd(fd, &len);
+	close(fd);
+	imgsize((const unsigned char *) data, len, &img->width, &img->height);
+
+	ext = strrchr(src, '.');
+	if ( ext && (strcmp(ext, exts[img->format]) == 0
+			|| (img->format == MD2ROFF_EPS && strcmp(ext, ".ps") == 0)) ) { // loaded as it is
+		snprintf(img->name, sizeof(img->name), "%s", src);
+		free(data);
+		return 0;
 		}
-	return bf;
+
+	hashadd(&h, &img->format, sizeof(img->format));
+	hashadd(&h, data, len);
+	free(data);
+	a = fmix64(h.a + h.b);
+	b = fmix64(h.b ^ a);
+	snprintf(img->name, sizeof(img->name), "%s/%016llx%016llx%s", imgdir,
+		(unsigned long long) a, (unsigned long long) b, exts[img->format]);
+	if ( access(img->name, F_OK) == -1 )
+		imgconvert(src, img->name);
+	return 0;
 }
 
 /*
- *	this converts the file 'docname',
- *	that is loaded in 'source', to *-roff.
+ * returns true if the document 'in' may have images
  */
-void md2roff(const char *docname, const char *source)
+bool hasimages(const input_t *in)
 {
-	const char *p = source, *pnext, *pstart;
-	char	*dest, *d;
-	bool	bline = true, bcode = false;
-	bool	bold = false, italics = false;
-	bool	inside_list = false;
-	bool	title_level = 0;
+	const char *p = in->data, *end = in->data + in->len;
 
-	stk_list_p = 0; // reset stack
-	
-	puts(".\\\" x-roff document");
-	switch ( mpack ) {
-	case mp_mm:
-		puts(".do mso m.tmac"); // mm package, AL BL DL LI LE
-		break;
-	case mp_mdoc:
-	case mp_man:
-		if ( mpack == mp_mdoc )
-			puts(".do mso mdoc.tmac"); // BSD man
-		else
-			puts(".do mso man.tmac"); // Linux man
-		
-		if ( *p == '#' && isspace(*(p+1)) ) {
-			printf(".TH ");
-			p = println(p+2);
-			}
-		else {
-			time_t tt = time(0);   // get time now
-			struct tm *t = localtime(&tt);
-			printf(".TH %s 7 %d-%02d-%02d document\n",
-				   docname,
-				   t->tm_year+1900, t->tm_mon+1, t->tm_mday);
-			}
-		break;
-	case mp_mom:
-		puts(".do mso mom.tmac"); // mom
-		printf(".TITLE \"%s\"\n", docname);
-		printf(".AUTHOR \"md2roff\"\n");
-		printf(".PAPER A4\n");
-		printf(".PRINTSTYLE TYPESET\n");
-		printf(".START\n");
-		break;
-		}
-
-	dest = (char *) malloc(64*1024);
-	d = dest;
-	while ( *p ) {
-
-		//////////////////////////////////
-		// inside code block
-		//////////////////////////////////
-		if ( bcode ) {
-			d = flushln(d, dest); // we dont care
-			
-			if ( strncmp(p, "```", 3) == 0 ) { // end of code-block
-				p += 3;
-				bcode = false;
-				roff(cblock_end);
-				d = flushln(d, dest);
-				continue;
-				}
-			else {
-				bool xchg_dot = false;
-				if ( *p == '.' ) {
-					if ( mpack == mp_mom )
-						puts(".ESC_CHAR !");
-					else
-						puts(".cc !");
-					xchg_dot = true;
-					}
-				p = println(p);
-				if ( xchg_dot ) {
-					if ( mpack == mp_mom )
-						puts(".ESC_CHAR .");
-					else
-						puts("!cc .");
-					}
+	while ( (p = memchr(p, '!', end - p)) != NULL && ++ p < end ) {
+		if ( *p == '[' )
+			return true;
+		}
+	return false;
+}
+
+/*
+ * converts 'in' through the cache; as convert()
+ */
+bool cachedconvert(md2roff_ctx *ctx, const char *name, const input_t *in, const md2roff_sink *sink)
+{
+	char	path[4096], buf[LOAD_CHUNK];
+	md2roff_buf	res = { NULL, 0, 0 };
+	md2roff_sink msink = { -1, &res };
+	ssize_t	n;
+	int		fd;
+	bool	ok = true;
+
+	errno = 0;
+	cachepath(path, sizeof(path), ctx, name, in);
+	if ( (fd = open(path, O_RDONLY)) != -1 ) { // hit
+		while ( ok && (n = read(fd, buf, sizeof(buf))) != 0 ) {
+			if ( n < 0 ) {
+				panicif(errno != EINTR, "Unable to read '%s'", path);
 				continue;
 				}
+			ok = sinkwrite(sink, buf, n);
+			}
+		close(fd);
+		}
+	else {
+		errno = 0; // of the miss
+		if ( md2roff_convert(ctx, name, in->data, in->len, &msink) == 0 ) {
+			storefile(path, res.data, res.len, 0600);
 			}
+		else // invalid document, not stored
+			ok = false;
+		if ( !sinkwrite(sink, res.data, res.len) )
+			ok = false;
+		free(res.data);
+		}
+	if ( !ok && errno )
+		fprintf(stderr, "%s: write failed [%s]\n", name, strerror(errno));
+	return ok;
+}
 
-		//////////////////////////////////
-		// ignore escape characters
-		if ( *p == '\\' ) {
-			p ++;
-			switch (*p) {
-			case 'n': *d ++ = '\n'; break;
-			case 'r': *d ++ = '\r'; break;
-			case 't': *d ++ = '\t'; break;
-			case 'f': *d ++ = '\f'; break;
-			case 'b': *d ++ = '\b'; break;
-			case 'a': *d ++ = '\a'; break;
-			case 'e': *d ++ = '\033'; break;
-			default:
-				*d ++ = *p;
-				}
-			p ++;
-			bline = false;
+/*
+ * converts the loaded document 'in', named 'name', to 'sink';
+ * returns false on failure.
+ */
+bool convert(md2roff_ctx *ctx, const char *name, const input_t *in, const md2roff_sink *sink)
+{
+	fflush(stdout); // the converter writes to the descriptor
+	if ( imgdir )
+		md2roff_setimages(ctx, image, (void *) name);
+	if ( cachedir && !(imgdir && hasimages(in)) ) // the images may have changed
+		return cachedconvert(ctx, name, in, sink);
+	errno = 0;
+	if ( md2roff_convert(ctx, name, in->data, in->len, sink) == 0 )
+		return true;
+	if ( errno )
+		fprintf(stderr, "%s: write failed [%s]\n", name, strerror(errno));
+	return false;
+}
+
+/*
+ * converts the document that is read from the descriptor 'fd' while
+ * it arrives, block by block, to 'sink'; returns false on failure.
+ */
+bool streamfd(md2roff_ctx *ctx, const char *name, int fd, const md2roff_sink *sink)
+{
+	char	buf[LOAD_CHUNK];
+	ssize_t	n;
+	int		rv;
+
+	fflush(stdout);
+	if ( imgdir )
+		md2roff_setimages(ctx, image, (void *) name);
+	errno = 0;
+	rv = md2roff_begin(ctx, name, sink);
+	while ( rv == 0 && (n = read(fd, buf, sizeof(buf))) != 0 ) {
+		if ( n < 0 ) {
+			panicif(errno != EINTR, "read failed");
 			continue;
 			}
-		
-		//////////////////////////////////
-		// beginning of line
-		//////////////////////////////////
-		if ( bline ) {
-			bline = false;
-			
-			if ( *p == '\n' ) { // empty line
-				d = flushln(d, dest);
-				
-				if ( stk_list_p ) {
-					roff(li_end);
-					roff(lst_close);
-					stk_list_p --;
-					}
-				roff(par_end);
-				bline = true;
-				p ++;
-				continue;
-				}
-			else if ( *p == '#' ) { // header
-				d = flushln(d, dest);
-				
-				pnext = strchr(p, '\n');
-				if ( pnext ) {
-					if ( *(pnext-1) != '#' ) {
-						int	level = 0;
-						while ( *p == '#' ) { level ++; p ++; }
-						while ( *p == ' ' || *p == '\t' ) p ++;
-						switch ( level ) {
-						case 1: roff(new_sh); break; // TH?
-						case 2: roff(new_sh); break;
-						case 3: roff(new_ss); break;
-						case 4:
-						default:
-							if ( mpack == mp_man ) {
-								printf(".TP\n\\fB");
-								p = println(p);
-								printf("\\fR");
-								}
-							else
-								roff(new_s4);
-							continue;
-							}
-						p = println(p);
-						}
-					else {
-						roff(box_open);
-						roff(ln_brk);
-						p = println(p);
-						roff(ln_brk);
-						roff(box_close);
-						continue;
-						}
-					}
-				}
-			else if ( (*(p+1) == ' ' || *(p+1) == '\t')
-				&& (*p == '*' || *p == '+' || *p == '-') ) { // unordered list
-				d = flushln(d, dest);
-				if ( stk_list_p )
-					roff(li_end);
-				else
-					roff(ul_open);
-				roff(li_open);
-				p ++;
-				continue;
-				}
-			else if ( isdigit(*p) ) { // ordered list
-				char	num[16], *n;
-				const char *pstub = p;
-
-				n = num;
-				while ( isdigit(*p) )
-					*n ++ = *p ++;
-				*n = '\0';
-				if ( *p == '.' ) {
-					d = flushln(d, dest);
-					if ( stk_list_p )
-						roff(li_end);
-					else
-						roff(ol_open);
-					stk_count[stk_list_p-1] = atoi(num);
-					roff(li_open);
-					p ++;
-					while ( *p == ' ' || *p == '\t' ) p ++;
-					continue;
-					}
-				p = pstub;
-				}
-			else if ( strncmp(p, "```", 3) == 0 ) { // open code-block
-				bcode = true;
-				p += 3;
-				d = flushln(d, dest);
-				roff(cblock_open);
-				continue;
-				}
-			} // inside if ( beginning of line )
-
-		//////////////////////////////////
-		// in line
-		//////////////////////////////////
-		if ( *p == '\n' ) {
-			if ( strncmp(p+1, "===", 3) == 0
-				|| strncmp(p+1, "---", 3) == 0
-				|| strncmp(p+1, "***", 3) == 0 ) {
-				char rc = *(p+1);
-				char	*prevln;
-				p = strchr(p+1, '\n');
-				if ( !p )
-					return;
-				if ( d == dest ) {
-					p ++;
-					continue;
-					}
+		rv = md2roff_feed(ctx, buf, n);
+		}
+	if ( md2roff_end(ctx) == 0 && rv == 0 )
+		return true;
+	if ( errno )
+		fprintf(stderr, "%s: write failed [%s]\n", name, strerror(errno));
+	return false;
+}
 
-				// this is ruler or section
-				*d = '\0';
-				prevln = strrchr(dest, '\n');
-				if ( prevln ) {
-					*prevln = '\0';
-					if ( prevln > dest )
-						puts(dest);
-					prevln ++;
-					roff(new_sh);
-					printf("%s\n", prevln);
-					d = dest;
-					}
-				else {
-					roff(new_sh);
-					d = flushln(d, dest);
-					}
-				
-				p ++;
-				continue;
-				}
-			else
-				*d ++ = ' ';
-
-			bline = true;
-			}
-		else if (
-			( *p == '*' && *(p+1) == '*' ) ||
-			( *p == '_' && *(p+1) == '_' ) ) { // strong
-			if ( bold ) {
-				bold = false;
-				if ( mpack == mp_mom )
-					d = stradd(d, "\\*[PREV]");
-				else
-					d = stradd(d, "\\fP");
-				}
-			else {
-				char pc = (p > source) ? *(p-1) : ' ';
-				if ( strchr("({[,.;`'\" \t\n", pc) != NULL ) {
-					bold = true;
-					if ( mpack == mp_mom )
-						d = stradd(d, "\\*[BD]");
-					else
-						d = stradd(d, "\\fB");
-					}
-				else {
-					*d ++ = *p;
-					*d ++ = *(p+1);
-					}
-				}
-			p += 2;
-			continue;
+/*
+ * --- statistics ---
+ *
+ * with --stats, the counters of each document (see md2roff.h) and the
+ * time to load it are printed to stderr, as one JSON object per line.
+ */
+static bool	stats;		// --stats
+
+/*
+ * returns the time in seconds
+ */
+double now(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * writes 'str' to 'fp' as a JSON string
+ */
+void jsonstr(FILE *fp, const char *str)
+{
+	fputc('"', fp);
+	for ( ; *str; str ++ ) {
+		unsigned char c = *str;
+		if ( c == '"' || c == '\\' )
+			fprintf(fp, "\\%c", c);
+		else if ( c < 0x20 )
+			fprintf(fp, "\\u%04x", c);
+		else
+			fputc(c, fp);
+		}
+	fputc('"', fp);
+}
+
+/*
+ * prints the counters of the document 'name' converted by 'ctx', which
+ * took 'load' seconds to load, and zeroes them
+ */
+void printstats(md2roff_ctx *ctx, const char *name, double load)
+{
+	static const char *pnames[] = { "mm", "man", "mdoc", "mom" };
+	const md2roff_stats *st = md2roff_getstats(ctx);
+	char	*line = NULL;
+	size_t	len = 0;
+	FILE	*fp = open_memstream(&line, &len); // so the line is written at once
+
+	panicif(fp == NULL, "out of memory");
+	fputs("{\"file\":", fp);
+	jsonstr(fp, name);
+	fprintf(fp, ",\"package\":\"%s\",\"cached\":%s", pnames[md2roff_package(ctx)],
+		( cachedir && st->docs == 0 ) ? "true" : "false");
+	fprintf(fp, ",\"load_ns\":%.0f,\"scan_ns\":%.0f,\"render_ns\":%.0f",
+		load * 1e9, st->scan * 1e9, st->render * 1e9);
+	fprintf(fp, ",\"bytes_in\":%lu,\"bytes_out\":%lu,\"bytes_saved\":%lu,\"flushes\":%lu"
+		",\"links\":%lu,\"code_lines\":%lu,\"list_depth\":%d,\"roff\":{",
+		st->bytes_in, st->bytes_out, st->bytes_saved, st->lines, st->links, st->code_lines,
+		st->list_depth);
+	for ( int i = 1; md2roff_element(i); i ++ )
+		fprintf(fp, "%s\"%s\":%lu", ( i > 1 ) ? "," : "", md2roff_element(i), st->roff[i]);
+	fputs("}}\n", fp);
+	panicif(fclose(fp) != 0, "out of memory");
+	fputs(line, stderr);
+	free(line);
+	md2roff_resetstats(ctx);
+}
+
+/*
+ * --- batch conversion ---
+ */
+typedef struct {
+	const char	*src;		// input file name
+	char		*dst;		// output file name, NULL for stdout
+	md2roff_buf	res;		// the output, if a worker converts it for stdout
+	bool		done;
+	bool		failed;
+	} job_t;
+
+typedef struct {
+	job_t		*jobs;
+	int			count;
+	int			next;		// next job to take
+	int			written;	// jobs that are written out
+	macropackage_t	mpack;
+	int			docthreads;	// threads for each document
+	md2roff_buf	*spare;		// written outputs, their memory is reused
+	int			nspare, maxspare;
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;	// signaled when a job is done
+	} batch_t;
+
+/*
+ * returns the output file name for 'src' in the directory 'dir', or in
+ * the directory of 'src' if 'dir' is NULL;
+ * foo.md becomes dir/foo.1 (dir/foo.mm, dir/foo.mom for mm and mom).
+ * The pointer must freed by the user.
+ */
+char *outname(const char *dir, const char *src, macropackage_t mp)
+{
+	const char *base = strrchr(src, '/'), *ext, *suffix;
+	char *name;
+
+	base = ( base ) ? base + 1 : src;
+	ext = strrchr(base, '.');
+	if ( ext == NULL || ext == base )
+		ext = base + strlen(base);
+	switch ( mp ) {
+	case mp_mm:  suffix = ".mm"; break;
+	case mp_mom: suffix = ".mom"; break;
+	default:	 suffix = ".1";
+		}
+	if ( dir == NULL ) {
+		name = (char *) malloc((ext - src) + strlen(suffix) + 1);
+		panicif(name == NULL, "out of memory");
+		sprintf(name, "%.*s%s", (int) (ext - src), src, suffix);
+		return name;
+		}
+	name = (char *) malloc(strlen(dir) + (ext - base) + strlen(suffix) + 2);
+	panicif(name == NULL, "out of memory");
+	sprintf(name, "%s/%.*s%s", dir, (int) (ext - base), base, suffix);
+	return name;
+}
+
+/*
+ * --- several outputs ---
+ *
+ * with --emit PKG:PATH,..., each file is converted to each macro package
+ * PKG, into its PATH, where '%' is the name of the file without its
+ * directory and suffix. The file is loaded and its blocks are found once
+ * for all of them (see md2roff_convertmany()).
+ */
+#define	MAX_EMIT	16
+
+static int				nemit;
+static macropackage_t	emitmp[MAX_EMIT];
+static const char		*emitpath[MAX_EMIT];
+
+/*
+ * sets the outputs of --emit from 'list'; returns false if it is invalid
+ */
+bool setemit(char *list)
+{
+	static const char *pnames[] = { [mp_mm] = "mm", [mp_man] = "man", [mp_mdoc] = "mdoc", [mp_mom] = "mom" };
+	char	*item, *path, *save;
+	int		mp;
+
+	for ( item = strtok_r(list, ",", &save); item; item = strtok_r(NULL, ",", &save) ) {
+		if ( (path = strchr(item, ':')) == NULL || path[1] == '\0' || nemit == MAX_EMIT )
+			return false;
+		*path ++ = '\0';
+		for ( mp = 0; mp < 4 && strcmp(item, pnames[mp]) != 0; mp ++ )
+			;
+		if ( mp == 4 )
+			return false;
+		emitmp[nemit] = (macropackage_t) mp;
+		emitpath[nemit ++] = path;
+		}
+	return nemit > 0;
+}
+
+/*
+ * returns the --emit output 'i' of the file 'src';
+ * the pointer must freed by the user.
+ */
+char *emitname(int i, const char *src)
+{
+	const char *base = strrchr(src, '/'), *ext, *p;
+	char	*name, *d;
+	size_t	nlen;
+
+	base = ( base ) ? base + 1 : src;
+	ext = strrchr(base, '.');
+	if ( ext == NULL || ext == base )
+		ext = base + strlen(base);
+	nlen = ext - base;
+	name = (char *) malloc(strlen(emitpath[i]) * (nlen + 1) + 1);
+	panicif(name == NULL, "out of memory");
+	for ( p = emitpath[i], d = name; *p; p ++ ) {
+		if ( *p == '%' ) {
+			memcpy(d, base, nlen);
+			d += nlen;
 			}
-		else if ( *p == '*' ||  *p == '_' ) { // emphasis
-			if ( italics ) {
-				italics = false;
-				if ( mpack == mp_mom )
-					d = stradd(d, "\\*[PREV]");
-				else
-					d = stradd(d, "\\fP");
-				}
-			else {
-				char pc = (p > source) ? *(p-1) : ' ';
-				if ( strchr("({[,.;`'\" \t\n", pc) != NULL ) {
-					italics = true;
-					if ( mpack == mp_mom )
-						d = stradd(d, "\\*[IT]");
-					else
-						d = stradd(d, "\\fI");
-					}
-				else
-					*d ++ = *p;
-				}
-			p ++;
-			continue;
+		else
+			*d ++ = *p;
+		}
+	*d = '\0';
+	return name;
+}
+
+/*
+ * converts 'in', the file 'name', to the outputs of --emit;
+ * returns false on failure.
+ */
+bool emit(md2roff_ctx *ctx, const char *name, const input_t *in)
+{
+	md2roff_sink sinks[MAX_EMIT];
+	char	*dst[MAX_EMIT];
+	bool	ok = true;
+	int		i;
+
+	for ( i = 0; i < nemit; i ++ ) {
+		dst[i] = emitname(i, name);
+		sinks[i].fd = open(dst[i], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		sinks[i].mem = NULL;
+		panicif(sinks[i].fd == -1, "Unable to create '%s'", dst[i]);
+		}
+	if ( imgdir )
+		md2roff_setimages(ctx, image, (void *) name);
+	errno = 0;
+	if ( md2roff_convertmany(ctx, name, in->data, in->len, emitmp, sinks, nemit) != 0 ) {
+		if ( errno )
+			fprintf(stderr, "%s: write failed [%s]\n", name, strerror(errno));
+		ok = false;
+		}
+	for ( i = 0; i < nemit; i ++ ) {
+		panicif(close(sinks[i].fd) == -1, "Unable to write '%s'", dst[i]);
+		free(dst[i]);
+		}
+	return ok;
+}
+
+/*
+ * converts the file of 'job' with the context 'ctx', to its output file,
+ * or to stdout; or into job->res if 'tomem' is true.
+ */
+void convjob(md2roff_ctx *ctx, job_t *job, bool tomem)
+{
+	input_t	in;
+	md2roff_sink sink = { STDOUT_FILENO, NULL };
+	double	load = ( stats ) ? now() : 0;
+
+	loadfile(&in, job->src);
+	if ( stats )
+		load = now() - load;
+	if ( nemit ) {
+		job->failed = !emit(ctx, job->src, &in);
+		if ( stats )
+			printstats(ctx, job->src, load);
+		unloadfile(&in);
+		return;
+		}
+	if ( job->dst ) {
+		sink.fd = open(job->dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		panicif(sink.fd == -1, "Unable to create '%s'", job->dst);
+		}
+	else if ( tomem ) {
+		sink.fd = -1;
+		sink.mem = &job->res;
+		}
+
+	job->failed = !convert(ctx, job->src, &in, &sink);
+	if ( stats )
+		printstats(ctx, job->src, load);
+
+	if ( job->dst )
+		panicif(close(sink.fd) == -1, "Unable to write '%s'", job->dst);
+	unloadfile(&in);
+}
+
+/*
+ * worker thread; takes the next job until there are no more,
+ * with a converter context of its own.
+ */
+void *worker(void *arg)
+{
+	batch_t		*bt = (batch_t *) arg;
+	md2roff_ctx	*ctx = md2roff_new(bt->mpack);
+	int			i;
+
+	md2roff_setthreads(ctx, bt->docthreads);
+	md2roff_settiming(ctx, stats);
+	md2roff_setcompact(ctx, compact);
+	if ( docdate[0] )
+		md2roff_setdate(ctx, docdate);
+	for ( ;; ) {
+		pthread_mutex_lock(&bt->lock);
+		i = bt->next ++;
+		while ( i - bt->written >= bt->maxspare ) // keep few outputs in memory
+			pthread_cond_wait(&bt->cond, &bt->lock);
+		if ( i < bt->count && bt->jobs[i].dst == NULL && bt->nspare )
+			bt->jobs[i].res = bt->spare[-- bt->nspare];
+		pthread_mutex_unlock(&bt->lock);
+		if ( i >= bt->count )
+			break;
+
+		convjob(ctx, &bt->jobs[i], true);
+
+		pthread_mutex_lock(&bt->lock);
+		bt->jobs[i].done = true;
+		pthread_cond_broadcast(&bt->cond);
+		pthread_mutex_unlock(&bt->lock);
+		}
+	md2roff_delete(ctx);
+	return NULL;
+}
+
+/*
+ * converts the 'count' jobs with 'nthreads' workers; output that goes
+ * to stdout is written in the order of the jobs.
+ * returns false if any conversion failed.
+ */
+bool batch(md2roff_ctx *ctx, job_t *jobs, int count, int nthreads)
+{
+	batch_t		bt;
+	pthread_t	*tid;
+	int			i;
+	bool		ok = true;
+
+	if ( nthreads > count )
+		nthreads = count;
+	if ( nthreads <= 1 ) {
+		for ( i = 0; i < count; i ++ ) {
+			convjob(ctx, &jobs[i], false);
+			ok = ok && !jobs[i].failed;
 			}
-		else if ( *p == '`' ) { // inline code
-			p ++;
-			if ( mpack == mp_mom )
-				d = stradd(d, "`\\*[CODE]");
-			else
-				d = stradd(d, "`\\f[CR]");
-			
-			while ( *p != '`' ) {
-				if ( *p == '\0' ) {
-					fprintf(stderr, "%s", "inline code (`) didnt closed.");
-					exit(EXIT_FAILURE);
-					}
-				*d ++ = *p ++;
-				}
+		return ok;
+		}
 
-			if ( mpack == mp_mom )
-				d = stradd(d, "\\*[CODE OFF]'");
+	bt.jobs = jobs;
+	bt.count = count;
+	bt.next = 0;
+	bt.mpack = md2roff_package(ctx);
+	bt.docthreads = md2roff_threads(ctx);
+	bt.written = 0;
+	bt.nspare = 0;
+	bt.maxspare = 2 * nthreads;
+	bt.spare = (md2roff_buf *) malloc(bt.maxspare * sizeof(md2roff_buf));
+	panicif(bt.spare == NULL, "out of memory");
+	pthread_mutex_init(&bt.lock, NULL);
+	pthread_cond_init(&bt.cond, NULL);
+	tid = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+	panicif(tid == NULL, "out of memory");
+	for ( i = 0; i < nthreads; i ++ )
+		panicif(pthread_create(&tid[i], NULL, worker, &bt) != 0, "pthread_create failed");
+
+	for ( i = 0; i < count; i ++ ) {
+		pthread_mutex_lock(&bt.lock);
+		while ( !jobs[i].done )
+			pthread_cond_wait(&bt.cond, &bt.lock);
+		pthread_mutex_unlock(&bt.lock);
+		ok = ok && !jobs[i].failed;
+		if ( jobs[i].dst == NULL ) {
+			fwrite(jobs[i].res.data, 1, jobs[i].res.len, stdout);
+			jobs[i].res.len = 0;
+			pthread_mutex_lock(&bt.lock);
+			if ( bt.nspare < bt.maxspare )
+				bt.spare[bt.nspare ++] = jobs[i].res;
 			else
-				d = stradd(d, "\\fP'");
-			}
-
-		//
-		//	Markdown link:
-		//
-		//	generic link syntax  [text](link)
-		//	image link syntax	![text](link)
-		//	man page syntax      [page section](man)
-		//
-		else if ( *p == '[' || (*p == '!' && *(p+1) == '[') ) { // markdown link
-			const char *pfin;
-			bool bimg = false;
-			if ( *p == '!' ) {
-				p ++;
-				bimg = true;
-				}
-			pstart = p + 1;
-			pnext = strchr(pstart, ']');
-			if ( pnext
-					 && ( *(pnext+1) == '(' )
-						 && ((pfin = strchr(pnext+2, ')')) != NULL)
-			   ) {
-				char *left = strdup(pstart);
-				char *rght = strdup(pnext+2);
-				char *cp;
-
-				d = flushln(d, dest);
-				
-				cp = strchr(left, ']');	*cp = '\0';
-				cp = strchr(rght, ')');	*cp = '\0';
-				
-//				if ( bimg ) // RTFM
-				if ( strcmp(rght, "man") == 0 )
-					roff(man_ref, left);
-				else
-					roff(url_mark, left, rght);
-				
-				// finish
-				free(left);
-				free(rght);
-				p = pfin + 1;
-				continue;
-				}
-			else {
-				*d ++ = *p ++;
+				free(jobs[i].res.data);
+			pthread_mutex_unlock(&bt.lock);
+			jobs[i].res.data = NULL;
+			}
+		pthread_mutex_lock(&bt.lock);
+		bt.written = i + 1;
+		pthread_cond_broadcast(&bt.cond);
+		pthread_mutex_unlock(&bt.lock);
+		}
+
+	for ( i = 0; i < nthreads; i ++ )
+		pthread_join(tid[i], NULL);
+	free(tid);
+	while ( bt.nspare )
+		free(bt.spare[-- bt.nspare].data);
+	free(bt.spare);
+	pthread_cond_destroy(&bt.cond);
+	pthread_mutex_destroy(&bt.lock);
+	return ok;
+}
+
+/*
+ * --- watch mode ---
+ *
+ * the files are converted, and again each time they change, until
+ * md2roff is killed. each one has its own incremental context, so an
+ * edit converts only the sections it changed (see md2roff.h), and the
+ * output file is replaced at once.
+ * Linux waits with inotify on the directories of the files, since many
+ * editors save to a new file that is renamed over the old one; other
+ * systems check the files with stat() every WATCH_POLL_MS.
+ */
+#define	WATCH_POLL_MS	250
+
+typedef struct {
+	job_t		*job;
+	md2roff_ctx	*ctx;		// keeps the sections of the last version
+	struct stat	st;			// the file when it was converted
+	int			wd;			// inotify watch of its directory
+	} watch_t;
+
+/*
+ * converts the file of 'w' if it is not the one converted last, or
+ * 'force' is true; a file that is missing (being saved) is skipped.
+ */
+void watchconv(watch_t *w, mode_t mode, bool force)
+{
+	struct stat	st;
+	md2roff_buf	res = { NULL, 0, 0 };
+	md2roff_sink sink = { -1, &res };
+	char	*data;
+	size_t	len;
+	int		fd;
+	double	load;
+
+	if ( stat(w->job->src, &st) == -1 || !S_ISREG(st.st_mode) )
+		return;
+	if ( !force && st.st_ino == w->st.st_ino && st.st_size == w->st.st_size
+			&& st.st_mtime == w->st.st_mtime && st.st_ctime == w->st.st_ctime )
+		return;
+	if ( (fd = open(w->job->src, O_RDONLY)) == -1 )
+		return;
+	w->st = st;
+	load = now();
+	data = loadfd(fd, &len); // a copy, the editor may truncate the file
+	load = now() - load;
+	close(fd);
+
+	errno = 0;
+	if ( md2roff_convert(w->ctx, w->job->src, data, len, &sink) != 0 )
+		fprintf(stderr, "%s: invalid document, %s is not updated\n", w->job->src, w->job->dst);
+	else if ( !storefile(w->job->dst, res.data, res.len, mode) )
+		fprintf(stderr, "Unable to write '%s' [%s]\n", w->job->dst, strerror(errno));
+	else
+		fprintf(stderr, "%s -> %s\n", w->job->src, w->job->dst);
+	if ( imgdir )
+		imgwait();
+	if ( stats )
+		printstats(w->ctx, w->job->src, load);
+	free(res.data);
+	free(data);
+}
+
+/*
+ * converts the 'count' 'jobs' with the settings of 'ctx' each time
+ * they change; does not return.
+ */
+void watch(md2roff_ctx *ctx, job_t *jobs, int count)
+{
+	watch_t	*ws;
+	mode_t	mode = umask(022);
+	int		i;
+
+	umask(mode);
+	mode = 0644 & ~mode;
+	ws = (watch_t *) calloc(count, sizeof(watch_t));
+	panicif(ws == NULL, "out of memory");
+	for ( i = 0; i < count; i ++ ) {
+		ws[i].job = &jobs[i];
+		ws[i].ctx = md2roff_new(md2roff_package(ctx));
+		ws[i].wd = -1;
+		if ( docdate[0] )
+			md2roff_setdate(ws[i].ctx, docdate);
+		md2roff_setincremental(ws[i].ctx, true);
+		if ( imgdir )
+			md2roff_setimages(ws[i].ctx, image, (void *) jobs[i].src);
+		md2roff_settiming(ws[i].ctx, stats);
+		md2roff_setcompact(ws[i].ctx, compact);
+		}
+
+#ifdef __linux__
+	int		fd = inotify_init1(IN_CLOEXEC);
+
+	for ( i = 0; fd != -1 && i < count; i ++ ) {
+		const char *base = strrchr(jobs[i].src, '/');
+		char	dir[4096];
+
+		if ( base == NULL )
+			snprintf(dir, sizeof(dir), ".");
+		else
+			snprintf(dir, sizeof(dir), "%.*s", (int) (base - jobs[i].src + 1), jobs[i].src);
+		if ( (ws[i].wd = inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO)) == -1 ) {
+			close(fd); // poll them
+			fd = -1;
+			}
+		}
+	for ( i = 0; i < count; i ++ )
+		watchconv(&ws[i], mode, true);
+	while ( fd != -1 ) {
+		union { struct inotify_event ev; char buf[4096]; } u; // aligned for the events
+		char	*buf = u.buf;
+		ssize_t	n = read(fd, buf, sizeof(u));
+
+		if ( n <= 0 ) {
+			panicif(n == 0 || errno != EINTR, "inotify read failed");
+			continue;
+			}
+		for ( char *p = buf; p < buf + n; ) {
+			const struct inotify_event *ev = (const struct inotify_event *) p;
+			p += sizeof(struct inotify_event) + ev->len;
+			if ( ev->len == 0 )
 				continue;
+			for ( i = 0; i < count; i ++ ) {
+				const char *base = strrchr(jobs[i].src, '/');
+				base = ( base ) ? base + 1 : jobs[i].src;
+				if ( ws[i].wd == ev->wd && strcmp(base, ev->name) == 0 )
+					watchconv(&ws[i], mode, true);
 				}
 			}
-		else {
-			*d = *p;
-			d ++;
+		}
+#else
+	for ( i = 0; i < count; i ++ )
+		watchconv(&ws[i], mode, true);
+#endif
+	for ( ;; ) {
+		struct timespec ts = { 0, WATCH_POLL_MS * 1000000L };
+		nanosleep(&ts, NULL);
+		for ( i = 0; i < count; i ++ )
+			watchconv(&ws[i], mode, false);
+		}
+}
+
+/*
+ * --- server ---
+ *
+ * with --serve SOCKET, md2roff listens on the Unix socket SOCKET for
+ * clients, or with --serve - it reads stdin and answers to stdout, until
+ * its end. the requests are
+ *
+ *	PKG LEN [NAME]\n	and LEN bytes of markdown
+ *
+ * where PKG is man, mdoc, mm or mom, and NAME the title of documents that
+ * do not start with one ("stdin" if it is missing). each one is answered,
+ * in the order of the requests of the client, with
+ *
+ *	OK LEN\n	and LEN bytes of roff, or
+ *	ERR LEN\n	and LEN bytes of the error message.
+ *
+ * one thread polls the clients, and a pool of workers, each with its own
+ * context, converts the requests. the contexts and the buffers of each
+ * client are kept for the next requests.
+ */
+#define	SERVE_MAXHDR	512					// longest request line
+#define	SERVE_MAXDOC	(256 * 1024 * 1024)	// largest document
+
+typedef struct client client_t;
+
+struct client {
+	int			rfd, wfd;	// the requests are read from 'rfd', answered to 'wfd'
+	md2roff_buf	in;			// the input that is not answered
+	md2roff_buf	res;		// the roff of the answer
+	char		head[32];	// the line of the answer
+	size_t		hlen, sent;	// its length, the bytes of the answer written
+	size_t		hdr, len;	// length of the request line and of its document
+	char		name[SERVE_MAXHDR];
+	macropackage_t	mp;
+	bool		busy;		// its request is converted or answered
+	bool		answered;	// the answer is ready to write
+	bool		eof;		// no more requests, it is closed after the answers
+	client_t	*next;		// in the queue of the workers, or of the answers
+	};
+
+typedef struct {
+	client_t	*todo, **todo_end;	// requests to convert, in order
+	client_t	*done;				// answers to write
+	int			wake[2];			// a byte for each answer, for poll()
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	} server_t;
+
+/*
+ * worker thread; converts the requests of the queue with a context of
+ * its own, that is kept for the next ones
+ */
+void *serveconv(void *arg)
+{
+	server_t	*sv = (server_t *) arg;
+	md2roff_ctx	*ctx = md2roff_new(mp_man);
+	client_t	*c;
+	int			rv;
+
+	md2roff_settiming(ctx, stats);
+	md2roff_setcompact(ctx, compact);
+	if ( docdate[0] )
+		md2roff_setdate(ctx, docdate);
+	for ( ;; ) {
+		pthread_mutex_lock(&sv->lock);
+		while ( sv->todo == NULL )
+			pthread_cond_wait(&sv->cond, &sv->lock);
+		c = sv->todo;
+		if ( (sv->todo = c->next) == NULL )
+			sv->todo_end = &sv->todo;
+		pthread_mutex_unlock(&sv->lock);
+
+		md2roff_sink sink = { -1, &c->res };
+		c->res.len = 0;
+		md2roff_setpackage(ctx, c->mp);
+		rv = md2roff_convert(ctx, c->name, c->in.data + c->hdr, c->len, &sink);
+		if ( stats )
+			printstats(ctx, c->name, 0);
+		if ( rv != 0 ) {
+			c->res.len = 0;
+			sinkwrite(&sink, "invalid document\n", 17);
 			}
+		c->hlen = snprintf(c->head, sizeof(c->head), "%s %zu\n", ( rv ) ? "ERR" : "OK", c->res.len);
+		c->sent = 0;
 
-		p ++;
+		pthread_mutex_lock(&sv->lock);
+		c->next = sv->done;
+		sv->done = c;
+		pthread_mutex_unlock(&sv->lock);
+		while ( write(sv->wake[1], "", 1) == -1 && errno == EINTR )
+			;
 		}
-	d = flushln(d, dest);
+	return NULL;
+}
 
-	free(dest);
+/*
+ * answers 'msg' to the invalid request of 'c', and closes it after that
+ */
+void servefail(client_t *c, const char *msg)
+{
+	md2roff_sink sink = { -1, &c->res };
+
+	c->res.len = 0;
+	sinkwrite(&sink, msg, strlen(msg));
+	c->hlen = snprintf(c->head, sizeof(c->head), "ERR %zu\n", c->res.len);
+	c->sent = 0;
+	c->busy = c->answered = c->eof = true;
+	c->in.len = c->hdr = c->len = 0;
 }
 
 /*
- * --- main() ---
+ * if the input of 'c' has a whole request, gives it to the workers;
+ * answers the invalid ones
  */
-static char *usage ="\
-usage: md2roff [options] [file1 .. [fileN]]\n\
-\t-n, --man\n\t\tuse man package (default)\n\
-\t-d, --mdoc\n\t\tuse mdoc package (BSD man-pages)\n\
-\t-m, --mm\n\t\tuse mm package\n\
-\t-o, --mom\n\t\tuse mom package\n\
-\t-h, --help\n\t\tprint this screen\n\
-\t-v, --version\n\t\tprint version information\n\
-";
+void serveparse(server_t *sv, client_t *c)
+{
+	static const char *pnames[] = { [mp_mm] = "mm", [mp_man] = "man", [mp_mdoc] = "mdoc", [mp_mom] = "mom" };
+	char	pkg[8], *nl, *end;
+	int		mp, n = 0;
+	unsigned long long len;
 
-static char *version ="\
-md2roff, version 1.1\n\
-Copyright (C) 2017 Free Software Foundation, Inc.\n\
-License GPLv3+: GNU GPL version 3 or later <http://gnu.org/licenses/gpl.html>.\n\
-This is free software: you are free to change and redistribute it.\n\
-There is NO WARRANTY, to the extent permitted by law.\n\
-";
+	if ( c->busy || c->in.len == 0 )
+		return;
+	if ( c->hdr == 0 ) {
+		if ( (nl = memchr(c->in.data, '\n', c->in.len)) == NULL ) {
+			if ( c->in.len >= SERVE_MAXHDR )
+				servefail(c, "request line too long\n");
+			return;
+			}
+		*nl = '\0';
+		if ( sscanf(c->in.data, "%7s %llu%n", pkg, &len, &n) != 2 || len > SERVE_MAXDOC ) {
+			servefail(c, "invalid request, it is: PKG LEN [NAME]\n");
+			return;
+			}
+		for ( mp = 0; mp < 4 && strcmp(pkg, pnames[mp]) != 0; mp ++ )
+			;
+		if ( mp == 4 ) {
+			servefail(c, "unknown package, it is man, mdoc, mm or mom\n");
+			return;
+			}
+		for ( end = c->in.data + n; *end == ' '; end ++ )
+			;
+		snprintf(c->name, sizeof(c->name), "%s", ( *end ) ? end : "stdin");
+		c->mp = (macropackage_t) mp;
+		c->len = len;
+		c->hdr = nl + 1 - c->in.data;
+		}
+	if ( c->in.len - c->hdr < c->len )
+		return;
+
+	c->busy = true;
+	c->next = NULL;
+	pthread_mutex_lock(&sv->lock);
+	*sv->todo_end = c;
+	sv->todo_end = &c->next;
+	pthread_cond_signal(&sv->cond);
+	pthread_mutex_unlock(&sv->lock);
+}
+
+/*
+ * writes what it can of the answer of 'c'; when all of it is written,
+ * drops its request and takes the next one. returns false if the client
+ * is gone.
+ */
+bool serveanswer(server_t *sv, client_t *c)
+{
+	struct iovec iov[2];
+	ssize_t	n;
+	int		cnt = 0;
+
+	if ( c->sent < c->hlen ) {
+		iov[cnt].iov_base = c->head + c->sent;
+		iov[cnt ++].iov_len = c->hlen - c->sent;
+		}
+	if ( c->res.len > 0 ) {
+		size_t off = ( c->sent > c->hlen ) ? c->sent - c->hlen : 0;
+		iov[cnt].iov_base = c->res.data + off;
+		iov[cnt ++].iov_len = c->res.len - off;
+		}
+	if ( (n = writev(c->wfd, iov, cnt)) < 0 )
+		return errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK;
+	c->sent += n;
+	if ( c->sent < c->hlen + c->res.len )
+		return true;
+
+	c->in.len -= c->hdr + c->len; // the next requests stay
+	memmove(c->in.data, c->in.data + c->hdr + c->len, c->in.len);
+	c->hdr = c->len = c->sent = c->hlen = 0;
+	c->busy = c->answered = false;
+	serveparse(sv, c);
+	return true;
+}
+
+/*
+ * reads what is there from 'c'; returns false if the client is gone
+ */
+bool serveread(server_t *sv, client_t *c)
+{
+	char	buf[LOAD_CHUNK];
+	md2roff_sink sink = { -1, &c->in };
+	ssize_t	n = read(c->rfd, buf, sizeof(buf));
+
+	if ( n < 0 )
+		return errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK;
+	if ( n == 0 ) {
+		c->eof = true;
+		if ( c->hdr || (c->in.len && !c->busy) ) // cut in the middle
+			c->in.len = c->hdr = c->len = 0;
+		return c->busy;
+		}
+	sinkwrite(&sink, buf, n);
+	serveparse(sv, c);
+	return true;
+}
+
+/*
+ * serves the requests of the Unix socket 'path', or of stdin if it is
+ * "-", with 'nthreads' workers; returns at the end of stdin.
+ */
+bool serve(const char *path, int nthreads)
+{
+	server_t	sv;
+	client_t	**cl = NULL, *c;
+	struct pollfd *pfd = NULL;
+	pthread_t	tid;
+	int			ncl = 0, alloc = 0, lfd = -1, i;
+	char		buf[256];
+
+	signal(SIGPIPE, SIG_IGN); // a client that is gone is an error of write()
+	sv.todo = sv.done = NULL;
+	sv.todo_end = &sv.todo;
+	panicif(pipe(sv.wake) == -1, "pipe failed");
+	pthread_mutex_init(&sv.lock, NULL);
+	pthread_cond_init(&sv.cond, NULL);
+	for ( i = 0; i < nthreads; i ++ ) {
+		panicif(pthread_create(&tid, NULL, serveconv, &sv) != 0, "pthread_create failed");
+		pthread_detach(tid);
+		}
+
+	if ( strcmp(path, "-") == 0 ) {
+		alloc = 1;
+		cl = (client_t **) calloc(1, sizeof(client_t *));
+		panicif(cl == NULL || (cl[0] = (client_t *) calloc(1, sizeof(client_t))) == NULL, "out of memory");
+		cl[0]->rfd = STDIN_FILENO;
+		cl[0]->wfd = STDOUT_FILENO;
+		ncl = 1;
+		}
+	else {
+		struct sockaddr_un sa;
+		struct stat st;
+
+		panicif(strlen(path) >= sizeof(sa.sun_path), "socket name too long '%s'", path);
+		memset(&sa, 0, sizeof(sa));
+		sa.sun_family = AF_UNIX;
+		strcpy(sa.sun_path, path);
+		if ( stat(path, &st) == 0 && S_ISSOCK(st.st_mode) ) // left by a server before
+			unlink(path);
+		lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+		panicif(lfd == -1 || bind(lfd, (struct sockaddr *) &sa, sizeof(sa)) == -1
+			|| listen(lfd, 64) == -1, "Unable to listen on '%s'", path);
+		fcntl(lfd, F_SETFL, O_NONBLOCK);
+		}
+
+	for ( ;; ) {
+		// the slots of pfd: the answers, the listener, and each client
+		pfd = (struct pollfd *) realloc(pfd, (alloc + 2) * sizeof(struct pollfd));
+		panicif(pfd == NULL, "out of memory");
+		pfd[0].fd = sv.wake[0];
+		pfd[0].events = POLLIN;
+		pfd[1].fd = lfd;
+		pfd[1].events = POLLIN;
+		for ( i = 0; i < ncl; i ++ ) {
+			c = cl[i];
+			pfd[i+2].revents = 0;
+			if ( c->answered ) {
+				pfd[i+2].fd = c->wfd;
+				pfd[i+2].events = POLLOUT;
+				}
+			else if ( !c->busy && !c->eof ) {
+				pfd[i+2].fd = c->rfd;
+				pfd[i+2].events = POLLIN;
+				}
+			else // converted now
+				pfd[i+2].fd = -1;
+			}
+		if ( poll(pfd, ncl + 2, -1) == -1 ) {
+			panicif(errno != EINTR, "poll failed");
+			continue;
+			}
+
+		if ( pfd[0].revents ) { // answers of the workers
+			while ( read(sv.wake[0], buf, sizeof(buf)) == -1 && errno == EINTR )
+				;
+			pthread_mutex_lock(&sv.lock);
+			for ( ; sv.done; sv.done = sv.done->next )
+				sv.done->answered = true;
+			pthread_mutex_unlock(&sv.lock);
+			}
+
+		for ( i = 0; i < ncl; i ++ ) {
+			bool alive = true;
+			c = cl[i];
+			if ( pfd[i+2].revents & POLLOUT )
+				alive = serveanswer(&sv, c);
+			else if ( pfd[i+2].revents & (POLLIN | POLLHUP | POLLERR) )
+				alive = serveread(&sv, c);
+			if ( alive && !(c->eof && !c->busy) )
+				continue;
+			if ( c->busy && !c->answered ) // a worker has it, it is closed later
+				continue;
+			if ( lfd == -1 ) // the end of stdin
+				return true;
+			close(c->rfd);
+			free(c->in.data);
+			free(c->res.data);
+			free(c);
+			cl[i --] = cl[-- ncl];
+			pfd[i+3] = pfd[ncl+2];
+			}
+
+		if ( lfd != -1 && (pfd[1].revents & POLLIN) ) { // new clients
+			int fd;
+			while ( (fd = accept(lfd, NULL, NULL)) != -1 ) {
+				fcntl(fd, F_SETFL, O_NONBLOCK);
+				if ( ncl == alloc ) {
+					alloc = ( alloc ) ? alloc * 2 : 16;
+					cl = (client_t **) realloc(cl, alloc * sizeof(client_t *));
+					panicif(cl == NULL, "out of memory");
+					}
+				panicif((c = (client_t *) calloc(1, sizeof(client_t))) == NULL, "out of memory");
+				c->rfd = c->wfd = fd;
+				cl[ncl ++] = c;
+				}
+			}
+		}
+}
 
 int main(int argc, char *argv[])
 {
-	int files[64];
-	int fc = 0;
-	
+	md2roff_ctx	*ctx;
+	job_t	*jobs;
+	int		fc = 0, nthreads = 1;
+	const char	*outdir = NULL, *serving = NULL;
+	bool	ok = true, watching = false;
+
+	jobs = (job_t *) calloc(argc, sizeof(job_t));
+	panicif(jobs == NULL, "out of memory");
+	ctx = md2roff_new(mp_man);
+	setdocdate(false);
+	if ( docdate[0] )
+		md2roff_setdate(ctx, docdate);
 	for ( int i = 1; i < argc; i ++ ) {
 		if ( argv[i][0] == '-' ) {
 			if ( argv[i][1] == '\0' ) { // read from stdin
-				char *buf = loadfile(NULL);
-				md2roff("stdin", buf);
-				free(buf);
+				input_t in;
+				md2roff_sink sink = { STDOUT_FILENO, NULL };
+				struct stat st;
+				double load = 0;
+				if ( fstat(STDIN_FILENO, &st) == 0 && !S_ISREG(st.st_mode) )
+					ok = streamfd(ctx, "stdin", STDIN_FILENO, &sink) && ok; // pipe, terminal
+				else {
+					load = now();
+					loadfile(&in, NULL);
+					load = now() - load;
+					ok = convert(ctx, "stdin", &in, &sink) && ok;
+					unloadfile(&in);
+					}
+				if ( stats )
+					printstats(ctx, "stdin", load);
 				}
 			else if ( strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0 )
 				printf("%s", usage);
 			else if ( strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--version") == 0 )
 				printf("%s", version);
 			else if ( strcmp(argv[i], "-n") == 0 || strcmp(argv[i], "--man") == 0 )
-				mpack = mp_man;
+				md2roff_setpackage(ctx, mp_man);
 			else if ( strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--mm") == 0 )
-				mpack = mp_mm;
+				md2roff_setpackage(ctx, mp_mm);
 			else if ( strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--mdoc") == 0 )
-				mpack = mp_mdoc;
+				md2roff_setpackage(ctx, mp_mdoc);
 			else if ( strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--mom") == 0 )
-				mpack = mp_mom;
+				md2roff_setpackage(ctx, mp_mom);
+			else if ( strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--jobs") == 0 ) {
+				if ( i + 1 == argc ) {
+					fprintf(stderr, "missing argument: [%s]\n", argv[i]);
+					return EXIT_FAILURE;
+					}
+				nthreads = atoi(argv[++ i]);
+				if ( nthreads <= 0 )
+					nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+				}
+			else if ( strcmp(argv[i], "-T") == 0 || strcmp(argv[i], "--threads") == 0 ) {
+				if ( i + 1 == argc ) {
+					fprintf(stderr, "missing argument: [%s]\n", argv[i]);
+					return EXIT_FAILURE;
+					}
+				md2roff_setthreads(ctx, atoi(argv[++ i]));
+				}
+			else if ( strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--cache-dir") == 0 ) {
+				if ( i + 1 == argc ) {
+					fprintf(stderr, "missing argument: [%s]\n", argv[i]);
+					return EXIT_FAILURE;
+					}
+				cachedir = argv[++ i];
+				panicif(mkdir(cachedir, 0755) == -1 && errno != EEXIST, "Unable to create '%s'", cachedir);
+				setdocdate(true); // the date is a part of the key
+				md2roff_setdate(ctx, docdate);
+				}
+			else if ( strcmp(argv[i], "-S") == 0 || strcmp(argv[i], "--serve") == 0 ) {
+				if ( i + 1 == argc ) {
+					fprintf(stderr, "missing argument: [%s]\n", argv[i]);
+					return EXIT_FAILURE;
+					}
+				serving = argv[++ i];
+				}
+			else if ( strcmp(argv[i], "-e") == 0 || strcmp(argv[i], "--emit") == 0 ) {
+				if ( i + 1 == argc ) {
+					fprintf(stderr, "missing argument: [%s]\n", argv[i]);
+					return EXIT_FAILURE;
+					}
+				if ( !setemit(argv[++ i]) ) {
+					fprintf(stderr, "invalid --emit, it is PKG:PATH,... : [%s]\n", argv[i]);
+					return EXIT_FAILURE;
+					}
+				}
+			else if ( strcmp(argv[i], "-i") == 0 || strcmp(argv[i], "--images") == 0 ) {
+				if ( i + 1 == argc ) {
+					fprintf(stderr, "missing argument: [%s]\n", argv[i]);
+					return EXIT_FAILURE;
+					}
+				imgdir = argv[++ i];
+				panicif(mkdir(imgdir, 0755) == -1 && errno != EEXIST, "Unable to create '%s'", imgdir);
+				}
+			else if ( strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--stats") == 0 ) {
+				stats = true;
+				md2roff_settiming(ctx, true);
+				}
+			else if ( strcmp(argv[i], "-w") == 0 || strcmp(argv[i], "--watch") == 0 )
+				watching = true;
+			else if ( strcmp(argv[i], "-C") == 0 || strcmp(argv[i], "--compact") == 0 ) {
+				compact = true;
+				md2roff_setcompact(ctx, true);
+				}
+			else if ( strcmp(argv[i], "-O") == 0 || strcmp(argv[i], "--outdir") == 0 ) {
+				if ( i + 1 == argc ) {
+					fprintf(stderr, "missing argument: [%s]\n", argv[i]);
+					return EXIT_FAILURE;
+					}
+				outdir = argv[++ i];
+				}
 			else
 				fprintf(stderr, "unknown option: [%s]\n", argv[i]);
 			}
 		else {
-			files[fc] = i;
+			jobs[fc].src = argv[i];
 			fc ++;
 			}
 		}
-		
-	for ( int i = 0; i < fc; i ++ ) {
-		char *buf = loadfile(argv[files[i]]);
-		md2roff(argv[files[i]], buf);
-		free(buf);
+
+	// converters at the same time, as the jobs or one per CPU
+	imgq.max = ( nthreads > 1 ) ? nthreads : (int) sysconf(_SC_NPROCESSORS_ONLN);
+	if ( imgq.max < 1 )
+		imgq.max = 1;
+
+	if ( serving ) { // workers as the jobs, or one per CPU
+		ok = serve(serving, ( nthreads > 1 ) ? nthreads : imgq.max);
+		free(jobs);
+		md2roff_delete(ctx);
+		return ( ok ) ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	if ( watching ) {
+		if ( fc == 0 || nemit ) {
+			fprintf(stderr, "--watch needs files, and cannot --emit\n");
+			return EXIT_FAILURE;
+			}
+		for ( int i = 0; i < fc; i ++ )
+			jobs[i].dst = outname(outdir, jobs[i].src, md2roff_package(ctx));
+		watch(ctx, jobs, fc);
+		}
+	if ( outdir ) {
+		for ( int i = 0; i < fc; i ++ )
+			jobs[i].dst = outname(outdir, jobs[i].src, md2roff_package(ctx));
 		}
+	ok = batch(ctx, jobs, fc, nthreads) && ok;
+	if ( imgdir )
+		ok = imgwait() && ok;
 
-	return EXIT_SUCCESS;
+	for ( int i = 0; i < fc; i ++ )
+		free(jobs[i].dst);
+	free(jobs);
+	md2roff_delete(ctx);
+	return ( ok ) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,199 @@
+/*
+ *	md2roff.h
+ *	libmd2roff, the markdown to troff converter as a library.
+ *
+ *	Copyright (C) 2017, Nicholas Christopoulos (mailto:nereus@freemail.gr)
+ *
+ *	License GPL3+
+ *	CC: std C99
+ * 	URL: http://github.com/nereusx/md2roff
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License.
+ *	See LICENSE for details.
+ */
+
+#ifndef MD2ROFF_H
+#define MD2ROFF_H
+
+#include <stddef.h>
+
+#define	MD2ROFF_VERSION	"1.1"
+
+/*
+ * revision of the roff that is written; it grows with each change of the
+ * output for the same input, so stored outputs of older ones can be told.
+ */
+#define	MD2ROFF_REVISION	4
+
+// macro packages
+typedef enum { MD2ROFF_MM, MD2ROFF_MAN, MD2ROFF_MDOC, MD2ROFF_MOM } md2roff_package_t;
+
+/*
+ * growable memory buffer;
+ * start it zeroed, 'data' must freed by the user.
+ */
+typedef struct {
+	char	*data;
+	size_t	len, size;
+	} md2roff_buf;
+
+/*
+ * where the roff output goes;
+ * to the descriptor 'fd', or, if 'fd' is -1, appended to 'mem'.
+ */
+typedef struct {
+	int			fd;
+	md2roff_buf	*mem;
+	} md2roff_sink;
+
+/*
+ * converter context, all the state of a conversion.
+ *
+ * A context converts one document at a time; use one per thread.
+ * Its buffers are kept between documents, so reusing a context for
+ * many conversions allocates only while they grow.
+ */
+typedef struct md2roff_ctx md2roff_ctx;
+
+md2roff_ctx		*md2roff_new(md2roff_package_t mp);
+void			md2roff_delete(md2roff_ctx *ctx);
+void			md2roff_setpackage(md2roff_ctx *ctx, md2roff_package_t mp);
+md2roff_package_t	md2roff_package(const md2roff_ctx *ctx);
+
+/*
+ * the date ("YYYY-MM-DD") of the header made for documents that do not
+ * start with a title; NULL, the default, uses the current date.
+ */
+void			md2roff_setdate(md2roff_ctx *ctx, const char *date);
+
+/*
+ * the deepest nesting of lists (32 by default, 0 restores it); items that
+ * are indented under an item of the deepest list continue that list.
+ */
+void			md2roff_setlistdepth(md2roff_ctx *ctx, int depth);
+
+/*
+ * images, ![text](file).
+ * man, mdoc and mm load them with .PSPIC, that reads EPS, and mom with
+ * .PDF_IMAGE, that reads PDF and needs their size. Without a callback
+ * the file is written as it is, and mom writes the text instead.
+ * With one, 'fn' is called for each image with the file as written and
+ * the format of the package, maybe at the same time from the threads of
+ * md2roff_convert(); it sets 'name' to the file to load and may set its
+ * size. It returns 0, or -1 to write the text instead of the image.
+ */
+enum { MD2ROFF_EPS, MD2ROFF_PDF };
+
+typedef struct {
+	const char	*src;			// the file of the document, not terminated
+	size_t		srclen;
+	int			format;			// MD2ROFF_EPS or MD2ROFF_PDF
+	char		name[4096];		// the file to load
+	int			width, height;	// its size in points, 0 if unknown
+	} md2roff_image;
+
+typedef int (*md2roff_imagefn)(void *arg, md2roff_image *img);
+
+void			md2roff_setimages(md2roff_ctx *ctx, md2roff_imagefn fn, void *arg);
+
+/*
+ * threads md2roff_convert() may use for one large document (1 by default,
+ * 0 for one per CPU); it is cut in chunks that are converted at the same
+ * time, the output is the same as with one thread.
+ */
+void			md2roff_setthreads(md2roff_ctx *ctx, int n);
+int				md2roff_threads(const md2roff_ctx *ctx);
+
+/*
+ * incremental conversion, for a document that is converted again after
+ * each edit; off by default.
+ * When it is on, 'ctx' keeps the output of each section of the document
+ * (cut before the headers that follow a blank line), and the next
+ * md2roff_convert() copies it for the sections that did not change.
+ * The output is the same; it converts with one thread.
+ */
+void			md2roff_setincremental(md2roff_ctx *ctx, int on);
+
+/*
+ * compact output; off by default.
+ * When it is on, the requests that do not change the formatted document
+ * are dropped as the output is written: a paragraph request before
+ * another paragraph or a section, or at the end, and the empty headings.
+ * It looks ahead one line, so in a stream the last paragraph request is
+ * written with the next line, and all the output of a memory sink is
+ * final after the conversion.
+ */
+void			md2roff_setcompact(md2roff_ctx *ctx, int on);
+
+/*
+ * counters of the conversions of a context, summed from its creation or
+ * the last md2roff_resetstats(). They are always counted; the times only
+ * after md2roff_settiming(ctx, 1). Sections that an incremental
+ * conversion copies are not converted, so they are not counted.
+ */
+#define	MD2ROFF_ELEMENTS	28
+
+typedef struct {
+	double			scan, render;	// seconds in the block pass and in the inline pass
+	unsigned long	docs;			// documents converted
+	unsigned long	bytes_in, bytes_out;
+	unsigned long	bytes_saved;	// dropped by md2roff_setcompact()
+	unsigned long	lines;			// text lines written
+	unsigned long	links;			// links, images and man page references
+	unsigned long	code_lines;		// lines inside code-blocks
+	int				list_depth;		// deepest list nesting
+	unsigned long	roff[MD2ROFF_ELEMENTS];	// roff requests, by element; see md2roff_element()
+	} md2roff_stats;
+
+void					md2roff_settiming(md2roff_ctx *ctx, int on);
+const md2roff_stats		*md2roff_getstats(const md2roff_ctx *ctx);
+void					md2roff_resetstats(md2roff_ctx *ctx);
+const char				*md2roff_element(int el);	// name of roff[el], NULL past the end
+
+/*
+ * converts the 'len' bytes of markdown 'src' (they do not need to be
+ * terminated) to roff, and writes it to 'sink'. 'docname' is the title
+ * used when the document does not start with one.
+ *
+ * returns 0 on success, -1 if the document is invalid or the output
+ * could not be written (errno is set for write errors).
+ * running out of memory is fatal.
+ */
+int		md2roff_convert(md2roff_ctx *ctx, const char *docname,
+			const char *src, size_t len, const md2roff_sink *sink);
+
+/*
+ * converts 'src' once for each of the 'n' macro packages 'mp', writing
+ * each to the sink of the same index; for the same output in several
+ * formats. The definitions and the blocks are found once (the blocks
+ * again for a package that starts the text elsewhere, as man and mdoc
+ * after the title line, so group those), and only the roff is written
+ * for each. It is not incremental; a large document that is converted
+ * with threads is cut and converted again for each package.
+ * The package of 'ctx' does not change. Returns -1 if any conversion
+ * failed, as md2roff_convert(), otherwise 0.
+ */
+int		md2roff_convertmany(md2roff_ctx *ctx, const char *docname, const char *src,
+			size_t len, const md2roff_package_t *mp, const md2roff_sink *sinks, int n);
+
+/*
+ * streaming conversion, for input that arrives in pieces (e.g. a pipe).
+ *
+ * md2roff_begin() starts the document, md2roff_feed() gives it the next
+ * 'len' bytes, in pieces of any size, and md2roff_end() finishes it.
+ * Each block is converted and written as soon as the blank line after it
+ * arrives, so only the current block is kept in memory; inline code and
+ * links cannot continue after a blank line. For the same reason only the
+ * definitions of the blocks received so far are known: a [id]: url or a
+ * [^n]: text after its use leaves the use as text, and the output is not
+ * the one of md2roff_convert().
+ *
+ * all return 0 or -1, as md2roff_convert(); once the document is found
+ * invalid the rest of the input is ignored.
+ */
+int		md2roff_begin(md2roff_ctx *ctx, const char *docname, const md2roff_sink *sink);
+int		md2roff_feed(md2roff_ctx *ctx, const char *src, size_t len);
+int		md2roff_end(md2roff_ctx *ctx);
+
+#endif
@@ -0,0 +1,705 @@
+/*
+ *	mdbench.c
+ *	A benchmark of libmd2roff, with generated documents.
+ *
+ *	Copyright (C) 2017, Nicholas Christopoulos (mailto:nereus@freemail.gr)
+ *
+ *	License GPL3+
+ *	CC: std C99
+ * 	URL: http://github.com/nereusx/md2roff
+ *
+ *	Each corpus is converted with each macro package, in a new process,
+ *	and the speed, the allocations and the peak memory are reported.
+ *	The corpora are generated with a fixed seed, so the numbers of two
+ *	builds can be compared; files given as arguments are measured too.
+ *
+ *	It must be linked with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc
+ *	(see the Makefile), so it can count the allocations.
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License.
+ *	See LICENSE for details.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "md2roff.h"
+
+/*
+ * --- allocation counter ---
+ */
+static unsigned long allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+	allocs ++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+	allocs ++;
+	return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	allocs ++;
+	return __real_realloc(ptr, size);
+}
+
+/*
+ * if 'when' is true, print error message and quit
+ */
+void panicif(int when, const char *msg)
+{
+	if ( when ) {
+		fprintf(stderr, "%s [%s]\n", msg, strerror(errno));
+		exit(EXIT_FAILURE);
+		}
+}
+
+/*
+ * --- corpus generator ---
+ *
+ * a corpus is a sequence of blocks; its mix gives the chance of each
+ * kind of block, and of the inline elements in their text.
+ */
+typedef enum { blk_para, blk_list, blk_code, blk_head, blk_kinds } blkkind_t;
+
+typedef struct {
+	const char	*name;
+	int			blocks[blk_kinds];	// weight of each kind of block
+	int			link, emph, code;	// per cent of the words that are links, emphasis, code
+	void		(*line)(md2roff_buf *b, unsigned i);	// or, for the hostile ones, line 'i'
+	} mix_t;
+
+static void genbrackets(md2roff_buf *b, unsigned i);
+static void genopenlinks(md2roff_buf *b, unsigned i);
+static void genrefs(md2roff_buf *b, unsigned i);
+static void gennesting(md2roff_buf *b, unsigned i);
+static void gentable(md2roff_buf *b, unsigned i);
+static void genlongline(md2roff_buf *b, unsigned i);
+
+static const mix_t mixes[] = {
+	{ "prose",    { 90,  0,  0, 10 },  1,  2,  1, NULL },
+	{ "links",    { 80, 10,  0, 10 }, 25,  2,  1, NULL },
+	{ "lists",    { 20, 70,  0, 10 },  3,  3,  2, NULL },
+	{ "code",     { 40,  0, 50, 10 },  1,  2, 10, NULL },
+	{ "emphasis", { 85,  5,  0, 10 },  1, 30,  2, NULL },
+	{ "mixed",    { 40, 20, 20, 20 },  8,  8,  4, NULL },
+	// hostile, for --scaling
+	{ "brackets",  { 0 }, 0, 0, 0, genbrackets },
+	{ "openlinks", { 0 }, 0, 0, 0, genopenlinks },
+	{ "refs",      { 0 }, 0, 0, 0, genrefs },
+	{ "nesting",   { 0 }, 0, 0, 0, gennesting },
+	{ "table",     { 0 }, 0, 0, 0, gentable },
+	{ "longline",  { 0 }, 0, 0, 0, genlongline },
+	};
+#define	MIXES	(int) (sizeof(mixes) / sizeof(mixes[0]))
+
+static const char *words[] = {
+	"the", "macro", "package", "of", "a", "page", "is", "converted", "to",
+	"roff", "and", "each", "line", "text", "with", "document", "markdown",
+	"output", "file", "in", "for", "header", "section", "list", "item",
+	"code", "block", "font", "bold", "inline", "options", "manual", "input",
+	"written", "when", "it", "are", "from", "that", "by", "as", "on", "or",
+	"be", "which", "this", "user", "command", "terminal", "width",
+	};
+#define	WORDS	(int) (sizeof(words) / sizeof(words[0]))
+
+static const char *codelines[] = {
+	"int main(int argc, char *argv[])",
+	"{",
+	"\tfor ( int i = 1; i < argc; i ++ )",
+	"\t\tputs(argv[i]); // print it",
+	"\treturn 0;",
+	"}",
+	"$ md2roff --man foo.md > foo.1",
+	"#define SIZE (64 * 1024)",
+	"x = y * 2 + [z] - _w_;",
+	".TH TITLE 1",
+	};
+#define	CODELINES	(int) (sizeof(codelines) / sizeof(codelines[0]))
+
+static uint64_t	seed;
+
+/*
+ * returns a pseudo-random number in [0, n)
+ */
+static unsigned rnd(unsigned n)
+{
+	seed ^= seed >> 12;
+	seed ^= seed << 25;
+	seed ^= seed >> 27;
+	return (unsigned) ((seed * 0x2545f4914f6cdd1dULL) >> 33) % n;
+}
+
+/*
+ * appends the 'len' bytes of 'str' to 'b'
+ */
+static void put(md2roff_buf *b, const char *str, size_t len)
+{
+	if ( b->len + len > b->size ) {
+		b->size = ( b->size ) ? b->size * 2 : 65536;
+		while ( b->size < b->len + len )
+			b->size *= 2;
+		b->data = (char *) realloc(b->data, b->size);
+		panicif(b->data == NULL, "out of memory");
+		}
+	memcpy(b->data + b->len, str, len);
+	b->len += len;
+}
+
+static void puts0(md2roff_buf *b, const char *str)
+{
+	put(b, str, strlen(str));
+}
+
+/*
+ * appends 'n' words of text, with the inline elements of 'mx'
+ */
+static void gentext(md2roff_buf *b, const mix_t *mx, int n)
+{
+	static const char *marks[] = { "*", "_", "**", "__" };
+	const char *w, *m;
+
+	for ( int i = 0; i < n; i ++ ) {
+		unsigned r = rnd(100);
+
+		if ( i )
+			puts0(b, " ");
+		w = words[rnd(WORDS)];
+		if ( r < (unsigned) mx->link ) {
+			if ( rnd(4) == 0 ) { // man page reference
+				puts0(b, "[");
+				puts0(b, w);
+				puts0(b, "(1)](man)");
+				}
+			else {
+				puts0(b, ( rnd(8) == 0 ) ? "![" : "[");
+				puts0(b, w);
+				puts0(b, " ");
+				puts0(b, words[rnd(WORDS)]);
+				puts0(b, "](https://example.com/");
+				puts0(b, w);
+				puts0(b, ".html)");
+				}
+			}
+		else if ( r < (unsigned) (mx->link + mx->emph) ) {
+			m = marks[rnd(4)];
+			puts0(b, m);
+			puts0(b, w);
+			if ( rnd(2) ) {
+				puts0(b, " ");
+				puts0(b, words[rnd(WORDS)]);
+				}
+			puts0(b, m);
+			}
+		else if ( r < (unsigned) (mx->link + mx->emph + mx->code) ) {
+			puts0(b, "`");
+			puts0(b, w);
+			puts0(b, "()`");
+			}
+		else
+			puts0(b, w);
+		}
+}
+
+/*
+ * appends a block of the kind 'k'
+ */
+static void genblock(md2roff_buf *b, const mix_t *mx, blkkind_t k)
+{
+	int		n;
+	char	num[16];
+
+	switch ( k ) {
+	case blk_para:
+		for ( n = 2 + rnd(5); n; n -- ) {
+			gentext(b, mx, 6 + rnd(10));
+			puts0(b, ( n > 1 && rnd(10) == 0 ) ? ".\n" : "\n");
+			}
+		break;
+	case blk_list:
+		for ( int i = 1, ordered = rnd(2), items = 3 + rnd(6); i <= items; i ++ ) {
+			if ( ordered ) {
+				snprintf(num, sizeof(num), "%d. ", i);
+				puts0(b, num);
+				}
+			else
+				puts0(b, ( rnd(3) == 0 ) ? "* " : ( rnd(2) ) ? "- " : "+ ");
+			gentext(b, mx, 3 + rnd(9));
+			puts0(b, "\n");
+			}
+		break;
+	case blk_code:
+		puts0(b, "```\n");
+		for ( n = 3 + rnd(15); n; n -- ) {
+			puts0(b, codelines[rnd(CODELINES)]);
+			puts0(b, "\n");
+			}
+		puts0(b, "```\n");
+		break;
+	default:
+		if ( rnd(4) == 0 ) { // setext
+			gentext(b, mx, 1 + rnd(4));
+			puts0(b, ( rnd(2) ) ? "\n=====\n" : "\n-----\n");
+			}
+		else {
+			puts0(b, "###" + rnd(3));
+			puts0(b, " ");
+			gentext(b, mx, 1 + rnd(4));
+			puts0(b, "\n");
+			}
+		}
+	puts0(b, "\n");
+}
+
+/*
+ * --- hostile corpora ---
+ *
+ * one paragraph of a pattern whose end the parser looks for and does not
+ * find, or that grows its state; a pass that searches again from each
+ * one, or walks its state, is quadratic with them.
+ */
+
+// links and images that are not closed
+static void genbrackets(md2roff_buf *b, unsigned i)
+{
+	puts0(b, ( i % 3 ) ? "[" : "![");
+	puts0(b, words[rnd(WORDS)]);
+	puts0(b, " ");
+	puts0(b, words[rnd(WORDS)]);
+	puts0(b, "\n");
+}
+
+// links without the ')' of their url
+static void genopenlinks(md2roff_buf *b, unsigned i)
+{
+	(void) i;
+	puts0(b, "[");
+	puts0(b, words[rnd(WORDS)]);
+	puts0(b, "](https://example.com/");
+	puts0(b, words[rnd(WORDS)]);
+	puts0(b, " and [text][\n");
+}
+
+// reference links, most of them defined
+static void genrefs(md2roff_buf *b, unsigned i)
+{
+	char	num[64];
+
+	if ( i % 4 == 0 ) {
+		snprintf(num, sizeof(num), "[id%u]: https://example.com/%u\n", i, i);
+		puts0(b, num);
+		}
+	snprintf(num, sizeof(num), "[%s][id%u] [%s] [^n%u]\n", words[rnd(WORDS)], rnd(i + 8),
+		words[rnd(WORDS)], rnd(i + 1));
+	puts0(b, num);
+}
+
+// list items that go deeper and back
+static void gennesting(md2roff_buf *b, unsigned i)
+{
+	for ( unsigned n = (i % 128 < 64) ? i % 64 : 127 - i % 128; n; n -- )
+		puts0(b, "  ");
+	puts0(b, ( i % 2 ) ? "- " : "1. ");
+	puts0(b, words[rnd(WORDS)]);
+	puts0(b, "\n");
+}
+
+// the rows of one table
+static void gentable(md2roff_buf *b, unsigned i)
+{
+	if ( i == 0 )
+		puts0(b, "| a | b | c |\n|:--|:-:|--:|\n");
+	for ( int c = 0; c < 3; c ++ ) {
+		puts0(b, "| ");
+		gentext(b, &mixes[5], 1 + rnd(( c == 2 ) ? 20 : 3));
+		puts0(b, " ");
+		}
+	puts0(b, "|\n");
+}
+
+// a paragraph of one line
+static void genlongline(md2roff_buf *b, unsigned i)
+{
+	(void) i;
+	gentext(b, &mixes[5], 16);
+	puts0(b, " ");
+}
+
+/*
+ * generates a corpus of the mix 'mx' with at least 'size' bytes into 'b'
+ */
+static void gencorpus(md2roff_buf *b, const mix_t *mx, size_t size)
+{
+	int		total = 0, r, k;
+
+	seed = 0x2545f4914f6cdd1dULL ^ (uint64_t) (mx - mixes + 1); // the same with any options
+	for ( k = 0; k < blk_kinds; k ++ )
+		total += mx->blocks[k];
+	b->len = 0;
+	puts0(b, "# BENCH 1\n\n");
+	for ( unsigned i = 0; mx->line && b->len < size; i ++ )
+		mx->line(b, i);
+	while ( b->len < size ) {
+		r = rnd(total);
+		for ( k = 0; r >= mx->blocks[k]; k ++ )
+			r -= mx->blocks[k];
+		genblock(b, mx, (blkkind_t) k);
+		}
+}
+
+/*
+ * --- measurement ---
+ */
+typedef struct {
+	double			best;			// seconds of the fastest conversion
+	int				reps;
+	unsigned long	first, next;	// allocations of the first and of the last conversion
+	long			rss;			// peak RSS growth, KB
+	bool			ok;
+	} result_t;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * converts 'doc' with the package 'mp' for at least 'mintime' seconds,
+ * in a new process, so its peak memory is its own.
+ */
+static result_t measure(const md2roff_buf *doc, md2roff_package_t mp, double mintime)
+{
+	result_t	res;
+	int			fds[2], status;
+	pid_t		pid;
+
+	memset(&res, 0, sizeof(res));
+	panicif(pipe(fds) == -1, "pipe failed");
+	fflush(stdout);
+	panicif((pid = fork()) == -1, "fork failed");
+	if ( pid == 0 ) {
+		md2roff_ctx	*ctx = md2roff_new(mp);
+		md2roff_sink sink = { open("/dev/null", O_WRONLY), NULL };
+		struct rusage before, after;
+		double		start, t, total = 0;
+		unsigned long n;
+
+		close(fds[0]);
+		md2roff_setdate(ctx, "2017-05-08");
+		getrusage(RUSAGE_SELF, &before);
+		res.ok = true;
+		res.best = 1e9;
+		for ( res.reps = 0; res.ok && (res.reps < 3 || total < mintime); res.reps ++ ) {
+			n = allocs;
+			start = now();
+			res.ok = md2roff_convert(ctx, "bench", doc->data, doc->len, &sink) == 0;
+			t = now() - start;
+			n = allocs - n;
+			if ( res.reps == 0 )
+				res.first = n;
+			res.next = n;
+			total += t;
+			if ( t < res.best )
+				res.best = t;
+			}
+		getrusage(RUSAGE_SELF, &after);
+		res.rss = after.ru_maxrss - before.ru_maxrss;
+#ifdef __APPLE__
+		res.rss /= 1024; // bytes there
+#endif
+		md2roff_delete(ctx);
+		if ( write(fds[1], &res, sizeof(res)) != sizeof(res) )
+			_exit(EXIT_FAILURE);
+		_exit(EXIT_SUCCESS);
+		}
+	close(fds[1]);
+	if ( read(fds[0], &res, sizeof(res)) != sizeof(res) )
+		res.ok = false;
+	close(fds[0]);
+	waitpid(pid, &status, 0);
+	return res;
+}
+
+/*
+ * measures 'doc', named 'name', with the packages 'packs' and prints
+ * a line for each one
+ */
+static bool bench(const char *name, const md2roff_buf *doc, const bool *packs, double mintime)
+{
+	static const char *pnames[] = { "mm", "man", "mdoc", "mom" };
+	result_t	res;
+	bool		ok = true;
+
+	for ( int mp = 0; mp < 4; mp ++ ) {
+		if ( !packs[mp] )
+			continue;
+		res = measure(doc, (md2roff_package_t) mp, mintime);
+		if ( !res.ok ) {
+			printf("%-12s %-5s  conversion failed\n", name, pnames[mp]);
+			ok = false;
+			continue;
+			}
+		printf("%-12s %-5s %7.2f %9.1f %8.2f %8lu %6lu %9ld\n", name, pnames[mp],
+			doc->len / 1e6, doc->len / 1e6 / res.best, res.best * 1e9 / doc->len,
+			res.first, res.next, res.rss);
+		}
+	return ok;
+}
+
+/*
+ * measures 'name', the corpus 'mx' or else the document 'src' repeated, at
+ * 'steps' sizes up to 'size', each twice the one before, with the packages
+ * 'packs'; prints a line for each size with the growth of the time, and
+ * fails when, from the first size to the last, it grew more than twice
+ * for each doubling, and SCALE_NOISE times more. the sizes are measured
+ * in turn SCALE_ROUNDS times and the fastest of each is kept, so a slow
+ * moment of the machine is not the time of one size.
+ */
+#define	SCALE_LIMIT		2.0		// for each doubling; 2 is linear and 4 quadratic
+#define	SCALE_NOISE		1.4		// once for all the sizes: the timer and the caches
+#define	SCALE_ROUNDS	5
+
+static bool scale(const char *name, const mix_t *mx, const md2roff_buf *src,
+	const bool *packs, size_t size, int steps, double mintime)
+{
+	static const char *pnames[] = { "mm", "man", "mdoc", "mom" };
+	md2roff_buf	doc[16];
+	result_t	res;
+	double		best[16], limit = SCALE_NOISE;
+	bool		ok = true, failed = false;
+
+	memset(doc, 0, sizeof(doc));
+	for ( int k = 0; k < steps; k ++ ) {
+		size_t	n = size >> (steps - 1 - k);
+
+		if ( mx )
+			gencorpus(&doc[k], mx, n);
+		else
+			while ( doc[k].len < n && src->len )
+				put(&doc[k], src->data, src->len);
+		if ( k )
+			limit *= SCALE_LIMIT;
+		}
+	for ( int mp = 0; mp < 4 && !failed; mp ++ ) {
+		if ( !packs[mp] )
+			continue;
+		for ( int k = 0; k < steps; k ++ )
+			best[k] = 1e9;
+		for ( int r = 0; r < SCALE_ROUNDS && !failed; r ++ ) {
+			for ( int k = 0; k < steps; k ++ ) {
+				res = measure(&doc[k], (md2roff_package_t) mp, mintime / SCALE_ROUNDS);
+				if ( !res.ok ) {
+					printf("%-12s %-5s  conversion failed\n", name, pnames[mp]);
+					failed = true;
+					break;
+					}
+				if ( res.best < best[k] )
+					best[k] = res.best;
+				}
+			}
+		if ( failed )
+			break;
+		for ( int k = 0; k < steps; k ++ ) {
+			printf("%-12s %-5s %7.2f %9.2f ", name, pnames[mp], doc[k].len / 1e6, best[k] * 1e3);
+			if ( k )
+				printf("%6.2f", best[k] / best[k - 1]);
+			else
+				printf("%6s", "-");
+			if ( k == steps - 1 && best[k] > best[0] * limit ) {
+				printf("  super-linear, %.1f times for %d times the size", best[k] / best[0], 1 << (steps - 1));
+				ok = false;
+				}
+			printf("\n");
+			}
+		}
+	for ( int k = 0; k < steps; k ++ )
+		free(doc[k].data);
+	return ok && !failed;
+}
+
+/*
+ * reads the file 'filename' into 'b'
+ */
+static void loadfile(md2roff_buf *b, const char *filename)
+{
+	char	msg[4200];
+	FILE	*fp = fopen(filename, "rb");
+	size_t	n;
+	char	buf[65536];
+
+	snprintf(msg, sizeof(msg), "Unable to read '%s'", filename);
+	panicif(fp == NULL, msg);
+	b->len = 0;
+	while ( (n = fread(buf, 1, sizeof(buf), fp)) > 0 )
+		put(b, buf, n);
+	panicif(ferror(fp), msg);
+	fclose(fp);
+}
+
+/*
+ * --- main() ---
+ */
+static char *usage ="\
+usage: mdbench [options] [file1 .. [fileN]]\n\
+\t-s, --size MB\n\t\tsize of each generated corpus (default 4)\n\
+\t-c, --corpus NAME\n\t\tgenerate only this corpus; prose, links, lists, code,\n\t\temphasis, mixed, the hostile brackets, openlinks, refs,\n\t\tnesting, table, longline, or none (default all, the\n\t\thostile ones only with -x)\n\
+\t-p, --package NAME\n\t\tuse only this package; man, mdoc, mm or mom (default all)\n\
+\t-t, --time SEC\n\t\tconvert each one again for at least SEC (default 0.5)\n\
+\t-x, --scaling N\n\t\tmeasure each one at N sizes up to --size, each twice the\n\t\tone before, and fail if the time grows more than twice\n\t\tfor each doubling from the first to the last\n\
+\t-g, --generate NAME\n\t\twrite the corpus NAME to stdout and exit\n\
+\t-h, --help\n\t\tprint this screen\n\
+";
+
+/*
+ * returns the index of the corpus 'name', or -1
+ */
+static int findmix(const char *name)
+{
+	for ( int i = 0; i < MIXES; i ++ )
+		if ( strcmp(mixes[i].name, name) == 0 )
+			return i;
+	return -1;
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *pnames[] = { "mm", "man", "mdoc", "mom" };
+	md2roff_buf	doc = { NULL, 0, 0 };
+	bool		packs[4] = { false, false, false, false }, allpacks = true;
+	bool		usemix[MIXES], allmixes = true, ok = true;
+	double		size = 4, mintime = 0.5;
+	int			i, m, gen = -1, steps = 0;
+
+	for ( m = 0; m < MIXES; m ++ )
+		usemix[m] = true;
+	for ( i = 1; i < argc; i ++ ) {
+		const char *opt = argv[i];
+
+		if ( opt[0] != '-' )
+			continue; // a file
+		if ( strcmp(opt, "-h") == 0 || strcmp(opt, "--help") == 0 ) {
+			printf("%s", usage);
+			return EXIT_SUCCESS;
+			}
+		if ( i + 1 == argc ) {
+			fprintf(stderr, "missing argument: [%s]\n", opt);
+			return EXIT_FAILURE;
+			}
+		const char *arg = argv[++ i];
+		argv[i] = NULL; // not a file
+		argv[i - 1] = NULL;
+		if ( strcmp(opt, "-s") == 0 || strcmp(opt, "--size") == 0 )
+			size = atof(arg);
+		else if ( strcmp(opt, "-t") == 0 || strcmp(opt, "--time") == 0 )
+			mintime = atof(arg);
+		else if ( strcmp(opt, "-c") == 0 || strcmp(opt, "--corpus") == 0 ) {
+			if ( (m = findmix(arg)) < 0 && strcmp(arg, "none") != 0 ) {
+				fprintf(stderr, "unknown corpus: [%s]\n", arg);
+				return EXIT_FAILURE;
+				}
+			if ( allmixes ) // the first -c
+				for ( int k = 0; k < MIXES; k ++ )
+					usemix[k] = false;
+			allmixes = false;
+			if ( m >= 0 )
+				usemix[m] = true;
+			}
+		else if ( strcmp(opt, "-p") == 0 || strcmp(opt, "--package") == 0 ) {
+			for ( m = 0; m < 4 && strcmp(pnames[m], arg) != 0; m ++ )
+				;
+			if ( m == 4 ) {
+				fprintf(stderr, "unknown package: [%s]\n", arg);
+				return EXIT_FAILURE;
+				}
+			packs[m] = true;
+			allpacks = false;
+			}
+		else if ( strcmp(opt, "-x") == 0 || strcmp(opt, "--scaling") == 0 ) {
+			if ( (steps = atoi(arg)) < 2 || steps > 16 ) {
+				fprintf(stderr, "the sizes to measure must be 2 to 16: [%s]\n", arg);
+				return EXIT_FAILURE;
+				}
+			}
+		else if ( strcmp(opt, "-g") == 0 || strcmp(opt, "--generate") == 0 ) {
+			if ( (gen = findmix(arg)) < 0 ) {
+				fprintf(stderr, "unknown corpus: [%s]\n", arg);
+				return EXIT_FAILURE;
+				}
+			}
+		else {
+			fprintf(stderr, "unknown option: [%s]\n", opt);
+			return EXIT_FAILURE;
+			}
+		}
+	if ( allpacks )
+		packs[0] = packs[1] = packs[2] = packs[3] = true;
+
+	if ( gen >= 0 ) {
+		gencorpus(&doc, &mixes[gen], (size_t) (size * 1e6));
+		fwrite(doc.data, 1, doc.len, stdout);
+		free(doc.data);
+		return EXIT_SUCCESS;
+		}
+
+	if ( steps ) {
+		printf("%-12s %-5s %7s %9s %6s\n", "corpus", "pack", "MB", "ms", "ratio");
+		for ( m = 0; m < MIXES; m ++ )
+			if ( usemix[m] )
+				ok = scale(mixes[m].name, &mixes[m], NULL, packs, (size_t) (size * 1e6),
+					steps, mintime) && ok;
+		for ( i = 1; i < argc; i ++ ) {
+			if ( argv[i] ) {
+				const char *base = strrchr(argv[i], '/');
+				loadfile(&doc, argv[i]);
+				ok = scale(( base ) ? base + 1 : argv[i], NULL, &doc, packs,
+					(size_t) (size * 1e6), steps, mintime) && ok;
+				}
+			}
+		free(doc.data);
+		return ( ok ) ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+
+	printf("%-12s %-5s %7s %9s %8s %8s %6s %9s\n", "corpus", "pack",
+		"MB", "MB/s", "ns/byte", "allocs", "next", "+RSS(KB)");
+	for ( m = 0; m < MIXES; m ++ ) {
+		if ( usemix[m] && (!mixes[m].line || !allmixes) ) {
+			gencorpus(&doc, &mixes[m], (size_t) (size * 1e6));
+			ok = bench(mixes[m].name, &doc, packs, mintime) && ok;
+			}
+		}
+	for ( i = 1; i < argc; i ++ ) {
+		if ( argv[i] ) {
+			const char *base = strrchr(argv[i], '/');
+			loadfile(&doc, argv[i]);
+			ok = bench(( base ) ? base + 1 : argv[i], &doc, packs, mintime) && ok;
+			}
+		}
+	free(doc.data);
+	return ( ok ) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,139 @@
+/*
+ *	mdfuzz.c
+ *	A fuzzer of libmd2roff, for libFuzzer or AFL.
+ *
+ *	Copyright (C) 2017, Nicholas Christopoulos (mailto:nereus@freemail.gr)
+ *
+ *	License GPL3+
+ *	CC: std C99
+ * 	URL: http://github.com/nereusx/md2roff
+ *
+ *	Each input is converted with each macro package, with and without
+ *	the compact output, with one thread and with FUZZ_THREADS; it aborts
+ *	when the threads do not write the same as one. libmd2roff.c is built
+ *	with it and -DSPLIT_MIN=64 (see the Makefile), so that small inputs
+ *	are cut in chunks too.
+ *
+ *	With -DMDFUZZ_MAIN it has a main(), that converts the files of its
+ *	arguments, or stdin without them, as AFL runs it; each one from a
+ *	buffer of its size.
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License.
+ *	See LICENSE for details.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "md2roff.h"
+
+#define	FUZZ_THREADS	3
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static const char *pnames[] = { "mm", "man", "mdoc", "mom" };
+
+/*
+ * converts 'data' with the packages; the contexts are kept, as a program
+ * that converts many documents keeps them
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	static md2roff_ctx	*ctx[2];	// one thread, FUZZ_THREADS
+	static md2roff_buf	out[2];
+	md2roff_sink	sink[2] = { { -1, &out[0] }, { -1, &out[1] } };
+	int		rc[2];
+
+	if ( ctx[0] == NULL ) {
+		for ( int i = 0; i < 2; i ++ ) {
+			ctx[i] = md2roff_new(MD2ROFF_MAN);
+			md2roff_setdate(ctx[i], "2017-05-08");
+			}
+		md2roff_setthreads(ctx[1], FUZZ_THREADS);
+		}
+	for ( int mp = MD2ROFF_MM; mp <= MD2ROFF_MOM; mp ++ ) {
+		for ( int compact = 0; compact < 2; compact ++ ) {
+			for ( int i = 0; i < 2; i ++ ) {
+				md2roff_setpackage(ctx[i], (md2roff_package_t) mp);
+				md2roff_setcompact(ctx[i], compact);
+				out[i].len = 0;
+				rc[i] = md2roff_convert(ctx[i], "fuzz", (const char *) data, size, &sink[i]);
+				}
+			if ( rc[0] != rc[1] || (rc[0] == 0 && (out[0].len != out[1].len
+					|| (out[0].len && memcmp(out[0].data, out[1].data, out[0].len) != 0))) ) {
+				fprintf(stderr, "mdfuzz: %s%s with %d threads differs from one\n",
+					pnames[mp], ( compact ) ? ", compact," : "", FUZZ_THREADS);
+				abort();
+				}
+			}
+		}
+	return 0;
+}
+
+#ifdef MDFUZZ_MAIN
+/*
+ * reads all of 'fp' into 'b'
+ */
+static void readall(FILE *fp, md2roff_buf *b)
+{
+	size_t	n;
+
+	b->len = 0;
+	do {
+		if ( b->len == b->size ) {
+			b->size = ( b->size ) ? b->size * 2 : 65536;
+			if ( (b->data = (char *) realloc(b->data, b->size)) == NULL ) {
+				fprintf(stderr, "mdfuzz: out of memory\n");
+				exit(EXIT_FAILURE);
+				}
+			}
+		n = fread(b->data + b->len, 1, b->size - b->len, fp);
+		b->len += n;
+		} while ( n );
+}
+
+/*
+ * converts a copy of 'b' of its exact size, as libFuzzer gives them, so
+ * that the sanitizers see a read past its end
+ */
+static void fuzzbuf(const md2roff_buf *b)
+{
+	char	*copy = (char *) malloc(( b->len ) ? b->len : 1);
+
+	if ( copy == NULL ) {
+		fprintf(stderr, "mdfuzz: out of memory\n");
+		exit(EXIT_FAILURE);
+		}
+	if ( b->len )
+		memcpy(copy, b->data, b->len);
+	LLVMFuzzerTestOneInput((const uint8_t *) copy, b->len);
+	free(copy);
+}
+
+int main(int argc, char *argv[])
+{
+	md2roff_buf	in = { NULL, 0, 0 };
+	FILE	*fp;
+
+	if ( argc < 2 ) {
+		readall(stdin, &in);
+		fuzzbuf(&in);
+		}
+	for ( int i = 1; i < argc; i ++ ) {
+		if ( (fp = fopen(argv[i], "rb")) == NULL ) {
+			fprintf(stderr, "mdfuzz: cannot open [%s]\n", argv[i]);
+			return EXIT_FAILURE;
+			}
+		readall(fp, &in);
+		fclose(fp);
+		fuzzbuf(&in);
+		}
+	free(in.data);
+	return EXIT_SUCCESS;
+}
+#endif